@@ -0,0 +1,320 @@
+#include "EncoderPool.h"
+#include "deinterleave.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+namespace {
+  /* Row tiles are rounded up to a multiple of this, so that they line up
+     with the de-interleave kernel's own tiles. */
+  const std::size_t TILE_ALIGN = 64;
+}
+
+
+EncoderPool::EncoderPool(EncoderBank &_encoders, unsigned _nChannels,
+			 const std::vector<std::uint32_t> &_columns, unsigned nThreads,
+			 unsigned _readSize, unsigned nBlocks) :
+  encoders(_encoders),
+  nChannels(_nChannels),
+  columns(_columns),
+  readSize(_readSize),
+  submitted(0),
+  nextToEncode(0),
+  queued(0),
+  stopping(false),
+  finished(false)
+{
+  if(nThreads == 0 || nBlocks == 0)
+    throw(std::runtime_error("EncoderPool needs at least one thread and one block"));
+
+  if(columns.size() != encoders.size())
+    throw(std::runtime_error("EncoderPool needs one encoder per selected channel"));
+
+  for(auto col: columns) {
+    if(col >= nChannels)
+      throw(std::out_of_range("EncoderPool: channel index " + std::to_string(col) + " is out of range"));
+  }
+
+  for(auto i=0U; i<nBlocks; i++) {
+    std::unique_ptr<SampleBlock> b(new SampleBlock);
+    b->data = new std::int16_t[std::size_t(readSize) * nChannels];
+    b->planes = new FLAC__int32[std::size_t(readSize) * columns.size()];
+    b->samples = reinterpret_cast<const char*>(b->data);
+    b->datalen = 0;
+    b->sequence = 0;
+    b->pendingTiles = 0;
+    b->pending = 0;
+    freeBlocks.push_back(b.get());
+    blocks.push_back(std::move(b));
+  }
+
+  for(auto i=0U; i<columns.size(); i++) {
+    std::unique_ptr<Channel> c(new Channel);
+    c->scheduled = false;
+    channels.push_back(std::move(c));
+  }
+
+  for(auto i=0U; i<nThreads; i++) {
+    std::unique_ptr<Worker> w(new Worker);
+    w->index = i;
+    workers.push_back(std::move(w));
+  }
+
+  for(auto &w: workers) {
+    Worker* wp = w.get();
+    w->thread = std::thread([this, wp]() { run(*wp); });
+  }
+}
+
+
+EncoderPool::~EncoderPool() {
+  if(!finished) {
+    try {
+      finish();
+    } catch(...) {
+      // Destructors can't throw; call finish() yourself to see the error
+    }
+  }
+
+  for(auto &b: blocks) {
+    delete[] b->data;
+    delete[] b->planes;
+  }
+}
+
+
+SampleBlock* EncoderPool::acquire() {
+  /* Returns an empty block for the reader to fill. Blocks until one of the
+     blocks that are in flight has been encoded by every channel. */
+  std::unique_lock<std::mutex> guard(freeLock);
+  blockFreed.wait(guard, [this]() { return !freeBlocks.empty(); });
+
+  SampleBlock* b = freeBlocks.back();
+  freeBlocks.pop_back();
+  return b;
+}
+
+
+void EncoderPool::submit(SampleBlock* block) {
+  if(block->datalen == 0 || columns.empty()) {
+    release(block);
+    return;
+  }
+
+  block->sequence = submitted++;
+  block->pendingTiles = unsigned(workers.size());
+  for(auto i=0U; i<workers.size(); i++)
+    push(i, Task{TRANSPOSE, block, i});
+}
+
+
+void EncoderPool::finish() {
+  /* Once every block has come home, there is nothing left to queue, so the
+     workers can finish their encoders and exit. */
+  if(finished)
+    return;
+  finished = true;
+
+  {
+    std::unique_lock<std::mutex> guard(freeLock);
+    blockFreed.wait(guard, [this]() { return freeBlocks.size() == blocks.size(); });
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(idleLock);
+    stopping = true;
+  }
+  wake.notify_all();
+
+  for(auto &w: workers) {
+    if(w->thread.joinable())
+      w->thread.join();
+  }
+
+  if(error)
+    std::rethrow_exception(error);
+}
+
+
+unsigned EncoderPool::home(unsigned chan) const {
+  /* ENCODE tasks start out on the worker that would have owned the channel
+     under a static split; stealing takes care of any imbalance. */
+  return unsigned((std::size_t(chan) * workers.size()) / channels.size());
+}
+
+
+void EncoderPool::push(unsigned worker, const Task &task) {
+  {
+    std::lock_guard<std::mutex> guard(workers[worker]->lock);
+    workers[worker]->tasks.push_back(task);
+  }
+
+  queued++;
+  {
+    std::lock_guard<std::mutex> guard(idleLock); // Don't lose a wakeup
+  }
+  wake.notify_one();
+}
+
+
+bool EncoderPool::pop(Worker &w, Task &task) {
+  {
+    std::lock_guard<std::mutex> guard(w.lock);
+    if(!w.tasks.empty()) {
+      task = w.tasks.front();
+      w.tasks.pop_front();
+      queued--;
+      return true;
+    }
+  }
+
+  for(auto i=1U; i<workers.size(); i++) {
+    Worker &victim = *workers[(w.index + i) % workers.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if(!victim.tasks.empty()) {
+      task = victim.tasks.back();
+      victim.tasks.pop_back();
+      queued--;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+void EncoderPool::release(SampleBlock* block) {
+  {
+    std::lock_guard<std::mutex> guard(freeLock);
+    freeBlocks.push_back(block);
+  }
+  blockFreed.notify_all();
+}
+
+
+void EncoderPool::run(Worker &w) {
+  while(true) {
+    Task task;
+    if(!pop(w, task)) {
+      std::unique_lock<std::mutex> guard(idleLock);
+      wake.wait(guard, [this]() { return queued > 0 || stopping; });
+      if(stopping && queued == 0)
+	break;
+      continue;
+    }
+
+    if(task.stage == TRANSPOSE) {
+      transpose(*task.block, task.index);
+    } else {
+      encode(w, task.index);
+    }
+  }
+
+  /* Finishing flushes the last frames and closes the file, so it can fail
+     too (e.g., on a full disk); finish() rethrows the first error. */
+  for(auto chan = 0U; chan < channels.size(); chan++) {
+    if(home(chan) != w.index)
+      continue;
+
+    try {
+      if(!encoders[chan]->finish())
+	throw(std::runtime_error("FLAC encoder could not finish channel index " + std::to_string(columns[chan])));
+    } catch(...) {
+      std::lock_guard<std::mutex> guard(errorLock);
+      if(!error)
+	error = std::current_exception();
+    }
+  }
+}
+
+
+void EncoderPool::transpose(SampleBlock &block, unsigned tile) {
+  /* Converts one tile of rows, for every selected channel, into the
+     channel-major planes. The last tile to finish hands the block on for
+     encoding. */
+  std::size_t rows = (block.datalen + workers.size() - 1) / workers.size();
+  rows = ((rows + TILE_ALIGN - 1) / TILE_ALIGN) * TILE_ALIGN;
+
+  std::size_t first = std::min(block.datalen, rows * tile);
+  std::size_t last  = std::min(block.datalen, first + rows);
+  if(first < last) {
+    deinterleaveColumns(block.samples + first * nChannels * sizeof(std::int16_t), last - first, nChannels,
+			columns.data(), columns.size(), block.planes + first, readSize);
+  }
+
+  if(--(block.pendingTiles) == 0)
+    schedule(block);
+}
+
+
+void EncoderPool::schedule(SampleBlock &block) {
+  /* Tiles can be stolen, so a later block may finish transposing before an
+     earlier one. Park it until its predecessors are through, then append
+     it to every channel's pending list. Holding orderLock throughout keeps
+     the channel lists in sequence order. */
+  std::lock_guard<std::mutex> order(orderLock);
+  transposed[block.sequence] = &block;
+
+  for(auto next = transposed.begin();
+      next != transposed.end() && next->first == nextToEncode;
+      next = transposed.erase(next), nextToEncode++) {
+
+    SampleBlock* b = next->second;
+    b->pending = unsigned(channels.size());
+    for(auto chan = 0U; chan < channels.size(); chan++) {
+      Channel &c = *channels[chan];
+      bool idle = false;
+      {
+	std::lock_guard<std::mutex> guard(c.lock);
+	c.blocks.push_back(b);
+	if(!c.scheduled) {
+	  c.scheduled = idle = true;
+	}
+      }
+
+      if(idle)
+	push(home(chan), Task{ENCODE, nullptr, chan});
+    }
+  }
+}
+
+
+void EncoderPool::encode(Worker &w, unsigned chan) {
+  /* Encodes the channel's oldest pending block. Only one ENCODE task per
+     channel exists at a time, so blocks are encoded in the order they
+     were read. */
+  Channel &c = *channels[chan];
+  SampleBlock* block;
+  {
+    std::lock_guard<std::mutex> guard(c.lock);
+    block = c.blocks.front();
+    c.blocks.pop_front();
+  }
+
+  /* Keep going after an error, so the reader is never left waiting for
+     a block that won't come back. The first error is rethrown by finish(). */
+  try {
+    const FLAC__int32* samples = block->planes + std::size_t(chan) * readSize;
+    if(!encoders[chan]->process(&samples, unsigned(block->datalen)))
+      throw(std::runtime_error("FLAC encoder failed on channel index " + std::to_string(columns[chan])));
+  } catch(...) {
+    std::lock_guard<std::mutex> guard(errorLock);
+    if(!error)
+      error = std::current_exception();
+  }
+
+  bool more;
+  {
+    std::lock_guard<std::mutex> guard(c.lock);
+    more = !c.blocks.empty();
+    if(!more)
+      c.scheduled = false;
+  }
+
+  if(more)
+    push(w.index, Task{ENCODE, nullptr, chan});
+
+  if(--(block->pending) == 0)
+    release(block);
+}
@@ -0,0 +1,155 @@
+/* EncoderPool: A long-lived set of worker threads for FLAC-encoding
+   blocks of NSx data.
+
+   Work is broken into small tasks that live on per-worker deques. A worker
+   runs tasks from the front of its own deque and, when that runs dry,
+   steals from the back of the others'. Idle workers therefore pick up
+   whatever is left, instead of waiting for the slowest worker's channels.
+
+   Each block passes through two stages:
+     1. TRANSPOSE: the block is split into one tile of rows (samples) per
+        worker, and each tile is de-interleaved into the block's
+        channel-major planes. The block is thus read from memory once.
+     2. ENCODE: once the last tile is done (and every earlier block has
+        been transposed too, since tiles can finish out of order), the
+        block is appended to every channel's list of pending blocks. Each
+        channel has at most one ENCODE task queued or running at a time,
+        which encodes that channel's oldest pending block and then
+        re-queues itself if more are waiting. A FLAC::Encoder::File
+        therefore always sees its blocks in order, no matter which worker
+        runs it.
+
+   A block goes back onto the free list once every channel has encoded it.
+
+   Only the channels listed in columns (indices into the file's channel
+   list) are transposed and encoded; encoders[k] receives channel
+   columns[k]. The other channels' samples are skipped entirely.
+
+   Usage:
+      EncoderPool pool(encoders, nChannels, columns, nThreads, readSize);
+      while(more data) {
+        SampleBlock* b = pool.acquire();  // Waits if every block is busy
+        b->datalen = file.readData(readSize, b->data);
+        b->samples = reinterpret_cast<const char*>(b->data);  // (or readView() for a mapped file)
+        pool.submit(b);
+      }
+      pool.finish(); // Drains the queues and finishes the encoders
+*/
+#pragma once
+#ifndef ENCODERPOOL_H_INCLUDED
+#define ENCODERPOOL_H_INCLUDED
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <FLAC++/encoder.h>
+
+#ifdef WINDOWS
+#include "mingw.thread.h"
+#include "mingw.mutex.h"
+#endif
+
+#include <thread>
+
+typedef std::vector<std::unique_ptr<FLAC::Encoder::File> > EncoderBank;
+
+
+struct SampleBlock {
+  std::int16_t* data;             // Buffer for readSize x nChannels interleaved samples
+  const char* samples;            // Raw bytes to encode: data, or a (possibly unaligned) view into a mapped file
+  std::size_t datalen;            // Number of samples per channel in data
+  std::uint64_t sequence;         // Order in which the block was submitted
+  FLAC__int32* planes;            // One plane of readSize samples per encoded channel
+
+  std::atomic<unsigned> pendingTiles; // Row tiles that have not been transposed yet
+  std::atomic<unsigned> pending;      // Channels that have not yet encoded this block
+};
+
+
+class EncoderPool {
+public:
+  EncoderPool(EncoderBank &encoders, unsigned nChannels,
+	      const std::vector<std::uint32_t> &columns, unsigned nThreads,
+	      unsigned readSize, unsigned nBlocks=2);
+  ~EncoderPool();
+
+  EncoderPool(const EncoderPool &rhs) = delete;
+  EncoderPool& operator=(const EncoderPool &rhs) = delete;
+
+  SampleBlock* acquire();
+  void submit(SampleBlock* block);
+  void finish();
+
+private:
+  enum Stage { TRANSPOSE, ENCODE };
+
+  struct Task {
+    Stage stage;
+    SampleBlock* block;           // Block to transpose (unused for ENCODE)
+    unsigned index;               // Row tile for TRANSPOSE, encoder for ENCODE
+  };
+
+  struct Worker {
+    unsigned index;
+    std::deque<Task> tasks;       // Owner takes from the front, thieves from the back
+    std::mutex lock;
+    std::thread thread;
+  };
+
+  struct Channel {
+    std::deque<SampleBlock*> blocks; // Transposed blocks waiting for this channel, oldest first
+    bool scheduled;                  // True while an ENCODE task for this channel exists
+    std::mutex lock;
+  };
+
+  EncoderBank &encoders;
+  const unsigned nChannels;              // Channels in the file (interleaved)
+  const std::vector<std::uint32_t> columns; // Channels to encode, one per encoder
+  const unsigned readSize;
+
+  std::vector<std::unique_ptr<Worker> > workers;
+  std::vector<std::unique_ptr<Channel> > channels;
+
+  // Transposed blocks are handed to the channels strictly in sequence
+  std::uint64_t submitted;
+  std::uint64_t nextToEncode;
+  std::map<std::uint64_t, SampleBlock*> transposed;
+  std::mutex orderLock;
+
+  // Idle workers sleep here until something is queued
+  std::atomic<std::size_t> queued;
+  std::mutex idleLock;
+  std::condition_variable wake;
+  bool stopping;
+
+  // Blocks are allocated once and recycled through this list
+  std::vector<std::unique_ptr<SampleBlock> > blocks;
+  std::vector<SampleBlock*> freeBlocks;
+  std::mutex freeLock;
+  std::condition_variable blockFreed;
+
+  std::exception_ptr error;
+  std::mutex errorLock;
+  bool finished;
+
+  void run(Worker &w);
+  bool pop(Worker &w, Task &task);
+  void push(unsigned worker, const Task &task);
+
+  void transpose(SampleBlock &block, unsigned tile);
+  void schedule(SampleBlock &block);
+  void encode(Worker &w, unsigned chan);
+  void release(SampleBlock* block);
+
+  unsigned home(unsigned chan) const;
+};
+
+#endif
@@ -1,26 +1,43 @@
-MATLAB_ROOT=/usr/local/MATLAB/R2018a
-CC=$(MATLAB_ROOT)/bin/mex
-CFLAGS=-v GCC=/usr/bin/gcc-5 -client engine -g -DMAT_FILE_SUPPORT
 LIBS=-lFLAC -lFLAC++ -lboost_program_options -lboost_filesystem -lboost_system
 TARGET = rippleToFlac
-DEPS = NSxFile.h NSxConfig.h MatFile.h
-OBJ = NSxConfig.o NSxFile.o NSxChannel.o NSxHeader.o nsx2mat.o nsx2txt.o rippleToFlac.o
+DEPS = NSxFile.h NSxConfig.h MatFile.h EncoderPool.h
+OBJ = NSxConfig.o NSxFile.o NSxChannel.o NSxHeader.o nsx2mat.o nsx2txt.o EncoderPool.o deinterleave.o rippleToFlac.o
 COMMON_OBJ = typeHelper.o MatFile.o
 
+ifdef NATIVE_MAT
+# make NATIVE_MAT=1 writes .mat files with matv5.cpp instead of the MATLAB
+# libraries, so only g++ and zlib are needed.
+CC=g++
+CFLAGS=-std=c++14 -O2 -g -pthread -DMAT_FILE_SUPPORT -DNATIVE_MAT_FILE
+LIBS+=-lz
+DEPS+=matv5.h
+COMMON_OBJ+=matv5.o
+OBJ_OUT=-o $@
+EXE_OUT=-o
+else
+MATLAB_ROOT=/usr/local/MATLAB/R2018a
+CC=$(MATLAB_ROOT)/bin/mex
+CFLAGS=-v GCC=/usr/bin/gcc-5 -client engine -g -DMAT_FILE_SUPPORT
+OBJ_OUT=$@
+EXE_OUT=-output
+endif
+
 
 %.o: %.cpp $(DEPS)
-	$(CC) -c $@ $< $(CFLAGS)
+	$(CC) -c $(OBJ_OUT) $< $(CFLAGS)
 
-rippleToFlac: $(COMMON_OBJ) NSxConfig.o NSxFile.o NSxChannel.o NSxHeader.o nsx2mat.o nsx2txt.o rippleToFlac.o
-	$(CC) -output $@ $^ $(CFLAGS) $(LIBS)
+rippleToFlac: $(COMMON_OBJ) NSxConfig.o NSxFile.o NSxChannel.o NSxHeader.o nsx2mat.o nsx2txt.o EncoderPool.o deinterleave.o rippleToFlac.o
+	$(CC) $(EXE_OUT) $@ $^ $(CFLAGS) $(LIBS)
 
-NEVExtract: $(COMMON_OBJ) datapacket.o NEVConfig.o NEVFile.o extheader.o NEVExtract.o saveNEVEvents.o
-	$(CC) -output $@ $^ $(CFLAGS) $(LIBS)
+NEVExtract: $(COMMON_OBJ) datapacket.o NEVConfig.o NEVFile.o extheader.o NEVExtract.o saveNEVEvents.o saveNEVSpikes.o spool.o textwriter.o waveform.o
+	$(CC) $(EXE_OUT) $@ $^ $(CFLAGS) $(LIBS)
+ifndef NATIVE_MAT
 	patchelf --set-rpath $(MATLAB_ROOT)/bin/glnxa64/ $@ 
+endif
 
 
-nev2plx: NEVFile.o extheader.o datapacket.o nev2plx_config.o nev2plx.o
-	$(CC) -output $@ $^ $(CFLAGS) $(LIBS)
+nev2plx: NEVFile.o extheader.o datapacket.o nev2plx_config.o plxwriter.o nev2plx.o
+	$(CC) $(EXE_OUT) $@ $^ $(CFLAGS) $(LIBS)
 
 .PHONY: clean
 clean:
@@ -154,15 +154,18 @@ void MATFile::putArray<bool>(const std::string& varname, const bool* values,
     n*= dims[i];
   }
 
+#ifdef NATIVE_MAT_FILE
+  putArrayDirect(varname, values, n, ndims, dims, asGlobal);
+#else
   MW::mxArray* newval = MW::mxCreateLogicalArray(ndims, dims);
 
+  /* mxLogical is bool in C++, so this can be a straight copy */
   if(newval) {
-    bool* dst = static_cast<bool*>(MW::mxGetData(newval));
-    for(MW::mwSize i=0; i < n; i++)
-      dst[i] = values[i];
+    std::memcpy(MW::mxGetData(newval), values, n * sizeof(bool));
   }
 
   check_put_and_dealloc(varname, newval, asGlobal);
+#endif
 
   return;
 }
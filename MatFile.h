@@ -2,20 +2,29 @@
 #ifndef MATFILE_H_INCLUDED
 #define MATFILE_H_INCLUDED
 
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <stdexcept>
 
+#ifdef NATIVE_MAT_FILE
+#include "matv5.h"
+#else
 namespace MW {
     // These are the original header files from the MathWorks.
     #include "mat.h"
     #include "matrix.h"
+}
+#endif
+
+namespace MW {
     const mwSize SCALAR_SIZE[2] = { static_cast<mwSize>(1), static_cast<mwSize>(1)};
 }
 
 #include "typeHelper.h"
 
+template <typename Scalar> class MATArrayStream;
 
 class MATFile {
     
@@ -70,41 +79,233 @@ public:
     void putArray(const std::string& varname, const Scalar* values,
 		  MW::mwSize ndims, const MW::mwSize* dims, bool asGlobal = false) {
 
-      MW::mxArray* newval = MW::mxCreateNumericArray(ndims,
-                                                       dims,
-                                                       typeHelper<Scalar>(),
-                                                       static_cast<MW::mxComplexity>(false));
       MW::mwSize n =1;
       for(MW::mwSize i=0; i < ndims; i++) {
             n*= dims[i];
       }
-        
+
+#ifdef NATIVE_MAT_FILE
+      /* No need for an mxArray (or a copy); values goes straight to disk */
+      putArrayDirect(varname, values, n, ndims, dims, asGlobal);
+#else
+      MW::mxArray* newval = MW::mxCreateNumericArray(ndims,
+                                                       dims,
+                                                       typeHelper<Scalar>(),
+                                                       static_cast<MW::mxComplexity>(false));
       if(newval) {
-            Scalar* data = static_cast<Scalar*>(MW::mxGetData(newval));
-            for(MW::mwSize i=0; i < n; i++) {
-                data[i] = values[i];
-            }
+            std::memcpy(MW::mxGetData(newval), values, n * sizeof(Scalar));
       }
         
       check_put_and_dealloc(varname, newval, asGlobal);
+#endif
       return;
     }
 
+    template <typename Scalar>
+    void putArray(const std::string& varname, const std::vector<Scalar>& values,
+		  MW::mwSize ndims, const MW::mwSize* dims, bool asGlobal = false) {
+      putArray(varname, values.data(), ndims, dims, asGlobal);
+    }
+
+    /* Marks the dimension passed to openArray() that grows as data is appended */
+    static const MW::mwSize DEFERRED = static_cast<MW::mwSize>(-1);
+
+    template <typename Scalar>
+    MATArrayStream<Scalar> openArray(const std::string& varname, MW::mwSize ndims,
+				     const MW::mwSize* dims, bool asGlobal = false);
+
     void rmVar(const std::string& varname);
     
     std::vector<std::string> getDir();
     
 
 protected:
+    template <typename> friend class MATArrayStream;
+
     MW::MATFile *mfp;
         
     int mode;
     std::string filename;
     
     void  check_put_and_dealloc(const std::string& varname, MW::mxArray* newval, bool asGlobal);
+
+#ifdef NATIVE_MAT_FILE
+    template <typename Scalar>
+    void putArrayDirect(const std::string& varname, const Scalar* values, MW::mwSize n,
+			MW::mwSize ndims, const MW::mwSize* dims, bool asGlobal);
+#endif
+};
+
+/* MATArrayStream writes one array variable a chunk at a time; get one from
+   MATFile::openArray(). With the native writer (NATIVE_MAT_FILE), chunks go
+   straight to disk, so memory use doesn't grow with the array. The MathWorks'
+   API can't do that, so there the chunks are collected and handed to
+   putArray() by close().
+
+   One of the dimensions may be MATFile::DEFERRED, in which case close() works
+   it out from the number of elements appended. Any dimensions after it must
+   be 1: {DEFERRED, 1} is a column vector, {52, DEFERRED} is one 52-sample
+   waveform per column, etc.
+
+   Don't write anything else to the file while a stream is open, and close the
+   stream before closing the file. The destructor closes the stream too, but
+   can't report errors. */
+template <typename Scalar>
+class MATArrayStream {
+public:
+    MATArrayStream(MATFile& _file, const std::string& _varname,
+		   MW::mwSize ndims, const MW::mwSize* _dims, bool _asGlobal = false);
+    ~MATArrayStream();
+
+    MATArrayStream(const MATArrayStream& rhs) = delete;
+    MATArrayStream& operator=(const MATArrayStream& rhs) = delete;
+    MATArrayStream(MATArrayStream&& rhs);
+    MATArrayStream& operator=(MATArrayStream&& rhs) = delete;
+
+    void append(const Scalar* values, std::size_t n);
+    void append(const std::vector<Scalar>& values) { append(values.data(), values.size()); }
+
+    void close();
+
+    std::size_t size() const { return count; }
+    bool isOpen() const { return file != nullptr; }
+
+protected:
+    MATFile* file;            // Null once closed
+    std::string varname;
+    std::vector<MW::mwSize> dims;
+    std::size_t deferred;     // Index of the deferred dimension, or dims.size()
+    bool asGlobal;
+    std::size_t count;        // Elements appended so far
+
+#ifndef NATIVE_MAT_FILE
+    std::vector<char> pending;
+#endif
 };
 
+
+template <typename Scalar>
+MATArrayStream<Scalar>::MATArrayStream(MATFile& _file, const std::string& _varname,
+				       MW::mwSize ndims, const MW::mwSize* _dims, bool _asGlobal) :
+    file(&_file), varname(_varname), dims(_dims, _dims + ndims), deferred(ndims),
+    asGlobal(_asGlobal), count(0) {
+
+    if(!file->isWritable())
+        throw(std::runtime_error("File " + file->filename + " is was not opened for writing (or has been closed)"));
+
+    for(std::size_t i = 0; i < dims.size(); i++) {
+        if(dims[i] == MATFile::DEFERRED) {
+            if(deferred != dims.size())
+                throw(std::runtime_error("Only one dimension of " + varname + " can be deferred"));
+            deferred = i;
+        } else if(deferred < i && dims[i] != 1) {
+            throw(std::runtime_error("Dimensions of " + varname + " after the deferred one must be 1"));
+        }
+    }
+
+#ifdef NATIVE_MAT_FILE
+    if(MW::matOpenArrayStream(file->mfp, varname.c_str(), typeHelper<Scalar>(),
+                              ndims, _dims, deferred, asGlobal)) {
+        throw(std::runtime_error("Unable to start variable " + varname + " in file " + file->filename + "."));
+    }
+#endif
+}
+
+
+template <typename Scalar>
+MATArrayStream<Scalar>::MATArrayStream(MATArrayStream&& rhs) :
+    file(rhs.file), varname(std::move(rhs.varname)), dims(std::move(rhs.dims)),
+    deferred(rhs.deferred), asGlobal(rhs.asGlobal), count(rhs.count)
+#ifndef NATIVE_MAT_FILE
+    , pending(std::move(rhs.pending))
+#endif
+{
+    rhs.file = nullptr;
+}
+
+
+template <typename Scalar>
+MATArrayStream<Scalar>::~MATArrayStream() {
+    try {
+        close();
+    } catch(...) {
+    }
+}
+
+
+template <typename Scalar>
+void MATArrayStream<Scalar>::append(const Scalar* values, std::size_t n) {
+    if(!file)
+        throw(std::runtime_error("Variable " + varname + " has already been closed"));
+
+#ifdef NATIVE_MAT_FILE
+    if(MW::matWriteArrayStream(file->mfp, values, n * sizeof(Scalar)))
+        throw(std::runtime_error("Unable to add " + std::to_string(n) + " elements to variable " +
+                                 varname + " in file " + file->filename + "."));
+#else
+    const char* bytes = reinterpret_cast<const char*>(values);
+    pending.insert(pending.end(), bytes, bytes + n * sizeof(Scalar));
+#endif
+    count += n;
+}
+
+
+template <typename Scalar>
+void MATArrayStream<Scalar>::close() {
+    if(!file)
+        return;
+
+    MATFile* f = file;
+    file = nullptr;
+
+#ifdef NATIVE_MAT_FILE
+    if(MW::matCloseArrayStream(f->mfp))
+        throw(std::runtime_error("Unable to finish variable " + varname + " in file " + f->filename +
+                                 " (" + std::to_string(count) + " elements written; is that the right size?)"));
+#else
+    MW::mwSize n = 1;
+    for(std::size_t i = 0; i < dims.size(); i++) {
+        if(i != deferred)
+            n *= dims[i];
+    }
+
+    if(deferred < dims.size() && n > 0 && count % n == 0)
+        dims[deferred] = count / n;
+    else if(deferred < dims.size() || count != n)
+        throw(std::runtime_error("Unable to finish variable " + varname + " in file " + f->filename +
+                                 " (" + std::to_string(count) + " elements written; is that the right size?)"));
+
+    std::vector<char> data;
+    data.swap(pending);
+    f->putArray(varname, reinterpret_cast<const Scalar*>(data.data()), dims.size(), dims.data(), asGlobal);
+#endif
+}
+
+
+#ifdef NATIVE_MAT_FILE
+template <typename Scalar>
+void MATFile::putArrayDirect(const std::string& varname, const Scalar* values, MW::mwSize n,
+			     MW::mwSize ndims, const MW::mwSize* dims, bool asGlobal) {
+    MATArrayStream<Scalar> stream(*this, varname, ndims, dims, asGlobal);
+    stream.append(values, n);
+    stream.close();
+}
+#endif
+
+
+template <typename Scalar>
+MATArrayStream<Scalar> MATFile::openArray(const std::string& varname, MW::mwSize ndims,
+					  const MW::mwSize* dims, bool asGlobal) {
+    return MATArrayStream<Scalar>(*this, varname, ndims, dims, asGlobal);
+}
+
+
 /* Specializations for MATFile::putScalar() */
+template <>
+void MATFile::putScalar<MW::mxArray*>(const std::string& varname,
+				      MW::mxArray* value,
+				      bool asGlobal);
+
 template <>
 void MATFile::putScalar<bool>(const std::string& varname,
 			      const bool value, bool
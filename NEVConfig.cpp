@@ -22,13 +22,23 @@ NEVConfig::NEVConfig(void) :
          "If empty or omitted, stimulation events are ignored. Otherwise, stimulation events are written in the specified formats. Supply more than one as a comma separated list.\n\t- matlab: MATLAB .mat file (version 7)\n\t- csv: comma-separated values\n\t- text: Pretty-printed text (no waveforms, regardless of include-stim-waveforms).")
     ("spike-filetype",
           opts::value<std::string>()->default_value(""),
-         "Currently unimplemented--throws if not empty. (This wouldn't be hard to fix). ")
+         "If empty or omitted, online-sorted spikes are ignored. Otherwise, spikes are written in the specified formats, grouped by electrode. Supply more than one as a comma separated list.\n\t- matlab: MATLAB .mat file (version 7)\n\t- csv: comma-separated values\n\t- text: Pretty-printed text\n\t- binary: Compact binary file (raw waveforms; see saveNEVSpikes.cpp)")
     ("include-stim-waveforms",
      opts::value<bool>()->default_value(true),
          "Include stimulation waveforms in output?. Waveforms are never included in the text file.")
     ("include-spike-waveforms",
      opts::value<bool>()->default_value(false),
-     "Include spike waveforms in output?");
+     "Include spike waveforms in output?")
+    ("mmap",
+#ifdef WINDOWS
+     opts::value<bool>()->default_value(false),
+#else
+     opts::value<bool>()->default_value(true),
+#endif
+     "Memory-map the NEV file instead of reading it through a stream (not available on Windows)")
+    ("threads",
+     opts::value<unsigned>()->default_value(1),
+     "Number of threads for decoding a memory-mapped NEV file and formatting text/CSV output");
 
   pos.add("input", 1);
   pos.add("output-prefix", 2);
@@ -36,7 +46,8 @@ NEVConfig::NEVConfig(void) :
   exts = {
     {OutputFormat::TEXT, "txt"},
     {OutputFormat::CSV, "csv"},
-    {OutputFormat::MATLAB, "mat"}
+    {OutputFormat::MATLAB, "mat"},
+    {OutputFormat::BINARY, "bin"}
   };
 };
 
@@ -70,6 +81,22 @@ size_t NEVConfig::bufferSize(void) const {
 }
 
 
+bool NEVConfig::useMmap(void) const {
+  if(!_valid)
+    throw(std::runtime_error("Options not initalized"));
+
+  return _useMmap;
+}
+
+
+unsigned NEVConfig::nThreads(void) const {
+  if(!_valid)
+    throw(std::runtime_error("Options not initalized"));
+
+  return _nThreads;
+}
+
+
 
 void NEVConfig::parse(int argc, char* argv[]) {
 
@@ -103,6 +130,8 @@ void NEVConfig::parse(int argc, char* argv[]) {
 
   _stimWaves = vm["include-stim-waveforms"].as<bool>();
   _spikeWaves = vm["include-spike-waveforms"].as<bool>();
+  _useMmap = vm["mmap"].as<bool>();
+  _nThreads = vm["threads"].as<unsigned>();
   _valid = true;
 }
 
@@ -175,7 +204,9 @@ NEVWorkQueue NEVConfig::toWorkQueue() {
 std::ostream& operator<<(std::ostream &out, const NEVConfig &c) {
   out << "Ripple Event Extraction Configuration: " << std::endl <<
     "\t Input: " << c._input << '\n' <<
-    "\t Output Prefix: " << c._outputPrefix << "\n\n";
+    "\t Output Prefix: " << c._outputPrefix << "\n" <<
+    "\t Memory-mapped input: " << (c._useMmap ? "Yes" : "No") << "\n" <<
+    "\t # of threads: " << c._nThreads << "\n\n";
 
   auto ev = c.eventFileTypes();
   if(ev.empty()) {
@@ -248,7 +279,8 @@ std::vector<OutputFormat> NEVConfig::parseFormatString(const std::string &fmtstr
   const std::map<std::string, OutputFormat> VALID_FORMATS {
     {"matlab", OutputFormat::MATLAB},
     {"csv",    OutputFormat::CSV},
-    {"text", OutputFormat::TEXT}
+    {"text", OutputFormat::TEXT},
+    {"binary", OutputFormat::BINARY}
   };
 
   while(getline(ss, token, DELIM)) {
@@ -296,6 +328,9 @@ std::ostream& operator<<(std::ostream &out, OutputFormat of) {
   case OutputFormat::MATLAB:
     out << "matlab";
     break;
+  case OutputFormat::BINARY:
+    out << "binary";
+    break;
   }
   return out;
 }
@@ -20,6 +20,7 @@ enum OutputFormat {
   TEXT   = 0,
   CSV    = 1,
   MATLAB = 2,
+  BINARY = 3,
 };
 std::ostream& operator<<(std::ostream &out, OutputFormat of);
     
@@ -51,6 +52,8 @@ class NEVConfig {
     
     
     size_t bufferSize() const;          
+    bool useMmap(void) const;
+    unsigned nThreads(void) const;
 
     bool valid(void) const { return(_valid); }
     bool isSingleFileConfig(void) const { return(_singleFile); }
@@ -82,6 +85,8 @@ class NEVConfig {
     bool _spikeWaves;
     
     size_t _bufferSize;
+    bool _useMmap;
+    unsigned _nThreads;
 
     void setInput(const opts::variables_map& vm);
 
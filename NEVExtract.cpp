@@ -1,6 +1,9 @@
+#include <algorithm>
 #include <cstddef>
 #include <iostream>
 #include <cstdint>
+#include <cstring>
+#include <limits>
 
 
 #include "MatFile.h"
@@ -8,69 +11,61 @@
 #include "NEVConfig.h"
 #include "datapacket.h"
 #include "eventsoa.h"
+#include "nevwriter.h"
+#include "packetsoa.h"
+#include "spool.h"
+#include "textwriter.h"
+#include "waveform.h"
 
 
-void saveEventsCSV(const NEVConfig &config, const NEVFile &f, const EventSOA &ev);
-void saveEventsMatlab(const NEVConfig &c, const NEVFile &f, const EventSOA &ev);
-void saveEventsText(const NEVConfig &config, const NEVFile &file, const EventSOA &ev);
+std::unique_ptr<EventWriter> openEventsCSV(const NEVConfig &config, const NEVFile &file);
+std::unique_ptr<EventWriter> openEventsMatlab(const NEVConfig &config, const NEVFile &file);
+std::unique_ptr<EventWriter> openEventsText(const NEVConfig &config, const NEVFile &file);
 
-void saveStimText(const NEVConfig &config, const NEVFile &file, const std::vector<std::shared_ptr<StimPacket>> &sp);
-void saveStimCSV(const NEVConfig &config, const NEVFile &file, const std::vector<std::shared_ptr<StimPacket>> &sp);
-void saveStimMatlab(const NEVConfig &config, const NEVFile &file, const std::vector<std::shared_ptr<StimPacket>> &sp);
+std::unique_ptr<StimWriter> openStimText(const NEVConfig &config, const NEVFile &file);
+std::unique_ptr<StimWriter> openStimCSV(const NEVConfig &config, const NEVFile &file);
+std::unique_ptr<StimWriter> openStimMatlab(const NEVConfig &config, const NEVFile &file);
 
+std::unique_ptr<SpikeWriter> openSpikes(const NEVConfig &config, const NEVFile &file);
 
-template <typename T>
-void toDouble(std::shared_ptr<StimPacket> ev, double* dest, int bps) {
-  std::cerr << "Converting with bps=" << bps << std::endl;
-  T* casted = reinterpret_cast<T*>(ev->waveform);
-  for(size_t i=0; i < (ev->len / bps); i++) {
-    dest[i] = double(casted[i]);
-  }
-  return;
-}
 
 /*void saveStimMatlab(const NEVConfig &config,
 		    const NEVFile &f,
 		    const std::vector<std::shared_ptr<StimPacket>> &sp) {
 }*/
 
-template<typename T>
-void notImplemented(const NEVConfig &c, const NEVFile &f, const T &t) {
+template<typename Writer>
+std::unique_ptr<Writer> notImplemented(const NEVConfig &, const NEVFile &) {
   throw(std::runtime_error("Method not (yet) implemented"));
 }
 
 
 
 
-typedef void (*event_writer_ptr)(const NEVConfig &,
-				 const NEVFile &,
-				 const EventSOA &);
-typedef void  (*stim_writer_ptr)(const NEVConfig &,
-	 			 const NEVFile &,
-				 const std::vector<std::shared_ptr<StimPacket>>&);
-typedef void (*spike_writer_ptr)(const NEVConfig &,
-				 const NEVFile &,
-				 const std::vector<std::shared_ptr<SpikePacket>>&);
+typedef std::unique_ptr<EventWriter> (*event_writer_ptr)(const NEVConfig &,
+							 const NEVFile &);
+typedef std::unique_ptr<StimWriter>  (*stim_writer_ptr)(const NEVConfig &,
+							const NEVFile &);
 
 
-const event_writer_ptr eventWriters[3] = {
-  saveEventsText,
-  saveEventsCSV,
-  saveEventsMatlab
+const event_writer_ptr eventWriters[4] = {
+  openEventsText,
+  openEventsCSV,
+  openEventsMatlab,
+  notImplemented<EventWriter>
 };
 
-const stim_writer_ptr stimWriters[3] = {
-  saveStimText,
-  saveStimCSV,
-  saveStimMatlab,
+const stim_writer_ptr stimWriters[4] = {
+  openStimText,
+  openStimCSV,
+  openStimMatlab,
+  notImplemented<StimWriter>
 };
 
-const spike_writer_ptr spikeWriters[3] = {
-  notImplemented,
-  notImplemented,
-  notImplemented
-};
 
+/* Packets per batch. Output is written as each batch is read, so this (and
+   not the size of the file) sets how much memory NEVExtract needs. */
+const std::size_t BATCH_PACKETS = 1 << 16;
 
 
 int main(int argc, char* argv[]) {
@@ -82,42 +77,50 @@ int main(int argc, char* argv[]) {
   bool saveStim    = !(config.stimFileTypes().empty());
   bool saveSpike   = !(config.spikeFileTypes().empty());
 
-  // Accumulate packets into these
-  EventSOA ev;
-  std::vector<std::shared_ptr<StimPacket>>    stim;
-  std::vector<std::shared_ptr<SpikePacket>>   spike;
-    
-  // Read from the file
-  NEVFile nev(config.input());
-  std::shared_ptr<Packet> packet;
-
-
-  while(!nev.eof()) {
-    packet = nev.readPacket(saveEvent, saveStim, saveSpike);
-    
-    if(auto p = std::dynamic_pointer_cast<DigitalPacket>(packet)) {
-        ev.addPacket(p);
-    } else if(auto p = std::dynamic_pointer_cast<StimPacket>(packet)) {
-         stim.push_back(p);
-    } else if(auto p = std::dynamic_pointer_cast<SpikePacket>(packet)) {
-        spike.push_back(p);
-    }
+  NEVFile nev(config.input(), 1000, config.useMmap());
+
+  // Start every output file
+  std::vector<std::unique_ptr<EventWriter> > eventOut;
+  for(auto fmt : config.eventFileTypes())
+    eventOut.push_back(eventWriters[fmt](config, nev));
+
+  std::vector<std::unique_ptr<StimWriter> > stimOut;
+  for(auto fmt : config.stimFileTypes())
+    stimOut.push_back(stimWriters[fmt](config, nev));
+
+  // Spikes are grouped by electrode, so every spike file type shares one writer
+  std::vector<std::unique_ptr<SpikeWriter> > spikeOut;
+  if(saveSpike)
+    spikeOut.push_back(openSpikes(config, nev));
+
+  // Read a batch at a time (in parallel, if it's mapped) and hand it to the writers
+  PacketSOA packets;
+  while(nev.readColumns(packets, BATCH_PACKETS, config.nThreads(),
+			saveEvent, saveStim, saveSpike) > 0) {
+    for(auto &w : eventOut)
+      w->append(packets.events);
+    for(auto &w : stimOut)
+      w->append(packets.stims);
+    for(auto &w : spikeOut)
+      w->append(packets.spikes);
+    packets.clear();
   }
 
-  //Write to output files
-  for(auto fmt : config.eventFileTypes()) {
+  //Finish the output files
+  for(auto &w : eventOut) {
     std::cout << "Starting to write event" << std::endl;
-    eventWriters[fmt](config, nev, ev);
+    w->finish();
     std::cout << "Finished writing event" << std::endl;
   }
 
-  for(auto fmt: config.stimFileTypes()) {
+  for(auto &w : stimOut) {
     std::cout << "Starting to write stim" << std::endl;
-    stimWriters[fmt](config, nev, stim);
+    w->finish();
   }
 
-  for(auto fmt: config.spikeFileTypes()) {
-    spikeWriters[fmt](config, nev, spike);
+  for(auto &w : spikeOut) {
+    std::cout << "Starting to write spikes" << std::endl;
+    w->finish();
   }
 
   
@@ -126,20 +129,25 @@ int main(int argc, char* argv[]) {
 
 
 template<typename T>
-std::string toStringHelper(std::shared_ptr<WavePacket> wp, char delim) {
-  std::ostringstream ss;
-  
-  T* tmp = reinterpret_cast<T*>(wp->waveform);
-  size_t i;
-  for(i=0; i<(wp->len)/sizeof(T) - 1; i++)
-    ss << tmp[i] << delim;
-  ss << tmp[i];
-  
-  return ss.str();
+void writeSamplesHelper(TextWriter &out, const StimSOA &wp, std::size_t index, char delim) {
+  const char* wave = wp.waveform(index);
+  const std::size_t n = wp.len[index] / sizeof(T);
+
+  // Waveforms aren't necessarily aligned, hence memcpy. Widened so that
+  // 8-bit samples come out as numbers, not characters
+  for(std::size_t i=0; i<n; i++) {
+    if(i)
+      out << delim;
+    T sample;
+    std::memcpy(&sample, wave + i * sizeof(T), sizeof(T));
+    out << static_cast<std::int64_t>(sample);
+  }
 }
 
 
-std::uint8_t getBytesPerSample(const NEVFile &file, const NEVConfig &config, std::uint16_t electrodeID, bool isStim=false) {
+/* Every waveform decoder handles 1, 2 or 4 bytes per sample, so anything
+   else is rejected here, once per electrode */
+std::uint8_t getBytesPerSample(const NEVFile &file, std::uint16_t electrodeID, bool isStim=false) {
   std::uint8_t bytesPerSample = 0;
 
   if(file.allWaves16Bit()) {
@@ -153,30 +161,30 @@ std::uint8_t getBytesPerSample(const NEVFile &file, const NEVConfig &config, std
       bytesPerSample = h.bytesPerSample;
     }
   }
+
+  if(bytesPerSample != 1 && bytesPerSample != 2 && bytesPerSample != 4) {
+    throw(std::runtime_error((isStim ? "Stim electrode " : "Electrode ") + std::to_string(electrodeID) +
+			     " has " + std::to_string(bytesPerSample) +
+			     " bytes per sample; only 1, 2 or 4 are supported"));
+  }
   return bytesPerSample;
 }
 
-std::string toString(std::shared_ptr<WavePacket> wp, const NEVFile &file,
-		     const NEVConfig &config, char delim=',') {
-
-  unsigned char bytesPerSample = getBytesPerSample(file, config, wp->electrodeID);
-
+void writeSamples(TextWriter &out, const StimSOA &wp, std::size_t index, unsigned bytesPerSample,
+		  char delim=',') {
   switch(bytesPerSample) {
   case 1:
-    return toStringHelper<std::int8_t>(wp, delim);
+    writeSamplesHelper<std::int8_t>(out, wp, index, delim);
     break;
   case 2:
-    return toStringHelper<std::int16_t>(wp, delim);
+    writeSamplesHelper<std::int16_t>(out, wp, index, delim);
     break;
   case 4:
-    return toStringHelper<std::int32_t>(wp, delim);
-    break;
-  case 8:
-    return toStringHelper<std::int64_t>(wp, delim);
+    writeSamplesHelper<std::int32_t>(out, wp, index, delim);
     break;
   default:
     std::ostringstream ss;
-    ss << "Unpacking " << bytesPerSample << " is not supported (yet).";
+    ss << "Unpacking " << int(bytesPerSample) << " is not supported (yet).";
     throw(std::runtime_error(ss.str()));
   }
 }
@@ -186,148 +194,342 @@ std::string toString(std::shared_ptr<WavePacket> wp, const NEVFile &file,
 
 
 
-void saveStimText(const NEVConfig &config, const NEVFile &file, const std::vector<std::shared_ptr<StimPacket>> &sp) {
+namespace {
 
-  const double stampToSec =  1.0 / static_cast<double>(file.get_timestampFS());
-  
-  std::string filename = config.stimFilename(OutputFormat::TEXT);
-  std::ofstream out(filename);
-  if(!out) {
-    throw(std::runtime_error("Unable to open " + filename + " for writing."));
-  }
+  /* Bytes per sample of each stim electrode, looked up in the headers the
+     first time the electrode turns up rather than once per event. */
+  class StimSampleSizes {
+  public:
+    StimSampleSizes(const NEVFile &_file) :
+      file(_file),
+      bytes(std::numeric_limits<std::uint16_t>::max() + 1, 0) {
+    }
+
+    /* Called before formatting a batch, so that the lookups from the
+       formatting threads are read-only */
+    void add(const StimSOA &sp) {
+      for(std::size_t p = 0; p < sp.size(); p++) {
+	std::uint16_t e = sp.electrode[p];
+	if(bytes[e] == 0) {
+	  try {
+	    bytes[e] = getBytesPerSample(file, e, true);
+	  } catch(const std::out_of_range &) {
+	    throw(std::runtime_error("No NEUEVWAV header for stim electrode " + std::to_string(e)));
+	  }
+	}
+      }
+    }
+
+    unsigned operator[](std::uint16_t e) const { return bytes[e]; }
+
+  private:
+    const NEVFile &file;
+    std::vector<std::uint8_t> bytes;
+  };
 
-  out << "Microstimulation events from " << config.input() << "\n\n";
 
-  for(auto p = sp.begin(); p != sp.end(); p++) {
-    
+  class StimText : public StimWriter {
+  public:
+    StimText(const NEVConfig &_config, const NEVFile &_file) :
+      config(_config), file(_file),
+      filename(config.stimFilename(OutputFormat::TEXT)),
+      out(filename),
+      text(out),
+      stampToSec(1.0 / static_cast<double>(file.get_timestampFS())),
+      sampleSizes(file) {
 
-    out << "Microstimulation event at t=" << (**p).timestamp * stampToSec
-	<< "sec (tick " << (*p)->timestamp << ")\n"
-	<< "\t- Electode: " << (*p)->electrodeID << "\n";
+      if(!out) {
+	throw(std::runtime_error("Unable to open " + filename + " for writing."));
+      }
 
-    if(config.includeStimWaves()) {
-      out << "\t- Waveform: [" << toString(*p, file, config) << "]\n";
+      text << "Microstimulation events from " << config.input() << "\n\n";
     }
-    out << "\n";
-  }
-  out.close();
-}
 
+    void append(const StimSOA &sp) override {
+      if(config.includeStimWaves())
+	sampleSizes.add(sp);
+
+      formatRows(text, sp.size(), config.nThreads(), [&](TextWriter &w, std::size_t begin, std::size_t end) {
+	  for(std::size_t p = begin; p < end; p++) {
+	    w << "Microstimulation event at t=" << sp.ts[p] * stampToSec
+	      << "sec (tick " << sp.ts[p] << ")\n"
+	      << "\t- Electode: " << sp.electrode[p] << "\n";
+
+	    if(config.includeStimWaves()) {
+	      w << "\t- Waveform: [";
+	      writeSamples(w, sp, p, sampleSizes[sp.electrode[p]]);
+	      w << "]\n";
+	    }
+	    w << "\n";
+	  }
+	});
+    }
 
-void saveStimCSV(const NEVConfig &config, const NEVFile &file, const std::vector<std::shared_ptr<StimPacket>> &sp) {
-  
-  const double stampToSec =  1.0 / static_cast<double>(file.get_timestampFS());
-   
-  std::string filename = config.stimFilename(OutputFormat::CSV);
-  std::ofstream out(filename);
-  if(!out) {
-    throw(std::runtime_error("Unable to open " + filename + " for writing."));
-  }
+    void finish() override {
+      text.flush();
+      out.close();
+      if(!out) {
+	throw(std::runtime_error("Error while writing " + filename));
+      }
+    }
 
-  out << "Time,Tic,Channel";
-  if(config.includeStimWaves())
-    out << ",Waveform";
-  out << "\n";
-  
-   for(auto p = sp.begin(); p != sp.end(); p++) {
-     out << (*p)->timestamp * stampToSec << ','
-	 << (*p)->timestamp << ','
-	 << (*p)->electrodeID << ',';
-
-     if(config.includeStimWaves()) {
-       out << toString(*p, file, config);
-     }
-     out << "\n";
-   }
-}
+  private:
+    const NEVConfig &config;
+    const NEVFile &file;
+    std::string filename;
+    std::ofstream out;
+    TextWriter text;
+    double stampToSec;
+    StimSampleSizes sampleSizes;
+  };
 
 
-void saveStimMatlab(const NEVConfig &config, const NEVFile &f, const std::vector<std::shared_ptr<StimPacket>> &sp) {
+  class StimCSV : public StimWriter {
+  public:
+    StimCSV(const NEVConfig &_config, const NEVFile &_file) :
+      config(_config), file(_file),
+      filename(config.stimFilename(OutputFormat::CSV)),
+      out(filename),
+      text(out),
+      stampToSec(1.0 / static_cast<double>(file.get_timestampFS())),
+      sampleSizes(file) {
+
+      if(!out) {
+	throw(std::runtime_error("Unable to open " + filename + " for writing."));
+      }
+
+      text << "Time,Tic,Channel";
+      if(config.includeStimWaves())
+	text << ",Waveform";
+      text << "\n";
+    }
 
-  std::string filename = config.stimFilename(OutputFormat::MATLAB);
-  std::cout << "   Writing events to matlab file as " << filename << std::endl;
-  MATFile m(filename, "wz");
+    void append(const StimSOA &sp) override {
+      if(config.includeStimWaves())
+	sampleSizes.add(sp);
+
+      formatRows(text, sp.size(), config.nThreads(), [&](TextWriter &w, std::size_t begin, std::size_t end) {
+	  for(std::size_t p = begin; p < end; p++) {
+	    w << sp.ts[p] * stampToSec << ','
+	      << sp.ts[p] << ','
+	      << sp.electrode[p] << ',';
+
+	    if(config.includeStimWaves()) {
+	      writeSamples(w, sp, p, sampleSizes[sp.electrode[p]]);
+	    }
+	    w << "\n";
+	  }
+	});
+    }
 
-  /* Set up the field names for the struct array */
-  static const char* event_fieldnames[] = {
-    "time",      // 0
-    "tick",      // 1
-    "electrode", // 2
-    "waveform"   // 3
+    void finish() override {
+      text.flush();
+      out.close();
+      if(!out) {
+	throw(std::runtime_error("Error while writing " + filename));
+      }
+    }
+
+  private:
+    const NEVConfig &config;
+    const NEVFile &file;
+    std::string filename;
+    std::ofstream out;
+    TextWriter text;
+    double stampToSec;
+    StimSampleSizes sampleSizes;
   };
 
-  size_t n_event_fields;
-  if(config.includeStimWaves()) {
-    n_event_fields = 4;
-  } else {
-    n_event_fields = 3;
-  }
 
-  const MW::mwSize event_dims[2] = { static_cast<MW::mwSize>(sp.size()), static_cast<MW::mwSize>(1) };
+  const std::size_t NO_SLOT = std::numeric_limits<std::size_t>::max();
 
-  
-  MW::mxArray* eventdata = MW::mxCreateStructArray(2, event_dims, 
-						n_event_fields, event_fieldnames);
+  class StimMatlab : public StimWriter {
+    /* One column per field, like the digital events, rather than a struct
+       per event: time, tick and electrode (Nx1), plus, with waveforms,
+       waveform_length (Nx1, in samples) and waveform (samples x N, in
+       volts). Waveforms shorter than the longest one are padded with NaN.
 
-  const double stampToSec =  1.0 / static_cast<double>(f.get_timestampFS());
+       Every variable needs the number of events up front, so the columns are
+       spooled to disk as they arrive and streamed into the file at the end.
+    */
+  public:
+    StimMatlab(const NEVConfig &_config, const NEVFile &_f) :
+      config(_config), f(_f),
+      slot(std::numeric_limits<std::uint16_t>::max() + 1, NO_SLOT),
+      n(0), nSamples(0) {
+    }
 
-  
-  /* We're going to cache the amp digitization factor and the bytes per sample so we don't
-     have to go back to the file object over and over again. We can use -1*/
-  std::vector<float>  toVoltFactor(5120, 0);
-  std::vector<std::uint8_t> bytesPerSample(5120,0); 
-
-  unsigned file_index = 0;
-  for(auto ev = sp.cbegin(); ev!=sp.end(); ev++, file_index++) {
-
-    std::uint16_t electrodeID = (*ev)->electrodeID;
-
-    
-    MW::mxSetFieldByNumber(eventdata, file_index, 0,
-			   MW::mxCreateDoubleScalar(static_cast<double>((*ev)->timestamp) * stampToSec));
-    MW::mxSetFieldByNumber(eventdata, file_index, 1,
-			   MW::mxCreateDoubleScalar(static_cast<double>((*ev)->timestamp)));
-    MW::mxSetFieldByNumber(eventdata, file_index, 2,
-			   MW::mxCreateDoubleScalar(static_cast<double>(electrodeID)));
-
-    if(config.includeStimWaves()) {
-      auto mat = MW::mxCreateDoubleMatrix((*ev)->len, 1, MW::mxREAL);
-      auto ptr = MW::mxGetPr(mat);
-
-      // Load things into the cache, if necessary. (There will be a spurious cache miss if there
-      // the conversion factor is 0 V/bit, but that's your fault for doing something dumb).
-      if(toVoltFactor[electrodeID] == 0) {
-          auto hdr = f.stimChannels_cfind(electrodeID);
-          toVoltFactor[electrodeID] = hdr.scaleFactor;
-          if(f.allWaves16Bit())
-              bytesPerSample[electrodeID] = 2;
-          else
-              bytesPerSample[electrodeID] = int(hdr.bytesPerSample);
-        }
-	
-
-      switch(bytesPerSample[electrodeID]) {
-         case 1:
-	   toDouble<char>(*ev, ptr, bytesPerSample[electrodeID]);
-	  break;
-      
-        case 2:
-	  toDouble<std::int16_t>(*ev, ptr, bytesPerSample[electrodeID]);
-	  break;
-
-        case 4:
-	  toDouble<std::int32_t>(*ev, ptr, bytesPerSample[electrodeID]);
-	  break;
-      default:
-	;//std::cerr << "NOT IMPLEMENTED: BPS=" << int(bytesPerSample[electrodeID]) <<  "  2VF=" << toVoltFactor[electrodeID] << std::endl;
-      }			       
-      std::cout << bytesPerSample[electrodeID];
-      MW::mxSetFieldByNumber(eventdata, file_index, 3, mat);			     
+    void append(const StimSOA &batch) override {
+      ts.write(batch.ts);
+      electrode.write(batch.electrode);
+      n += batch.size();
+
+      if(config.includeStimWaves()) {
+	for(std::size_t i = 0; i < batch.size(); i++) {
+	  const ElectrodeScale &e = scale(batch.electrode[i]);
+	  const std::uint32_t samples = batch.len[i] / e.bytesPerSample;
+	  waveLength.write(&samples, sizeof(samples));
+	  waves.write(batch.waveform(i), samples * e.bytesPerSample);
+	  nSamples = std::max<std::size_t>(nSamples, samples);
+	}
+      }
     }
-  }
 
-  m.putScalar("microstim", eventdata);
-   
+    void finish() override {
+      std::string filename = config.stimFilename(OutputFormat::MATLAB);
+      std::cout << "   Writing microstimulation events to matlab file as " << filename << std::endl;
+      MATFile m(filename, "wz");
+
+      MW::mwSize dim1x[2] = { static_cast<MW::mwSize>(n), 1 };
+
+      const double stampToSec =  1.0 / static_cast<double>(f.get_timestampFS());
+      {
+	auto out = m.openArray<double>("time", 2, dim1x);
+	std::vector<double> buffer;
+	ts.replay<std::uint32_t>([&](const std::uint32_t* v, std::size_t k) {
+	    buffer.resize(k);
+	    std::transform(v, v + k, buffer.begin(), [stampToSec](std::uint32_t t) { return double(t) * stampToSec; });
+	    out.append(buffer.data(), k);
+	  });
+	out.close();
+      }
+      streamColumn<std::uint32_t>(m, "tick", ts, dim1x);
+      streamColumn<std::uint16_t>(m, "electrode", electrode, dim1x);
+
+      if(config.includeStimWaves()) {
+	streamColumn<std::uint32_t>(m, "waveform_length", waveLength, dim1x);
+	writeWaveforms(m);
+      }
+    }
+
+  private:
+    struct ElectrodeScale {
+      std::uint8_t bytesPerSample;
+      double scale;                // Volts per bit
+    };
+
+    const ElectrodeScale& scale(std::uint16_t e) {
+      /* A slot for every possible electrode ID keeps the lookup cheap */
+      if(slot[e] == NO_SLOT) {
+	ElectrodeScale s{0, 0.0};
+	try {
+	  s.bytesPerSample = getBytesPerSample(f, e, true);
+	  s.scale = f.stimChannels_cfind(e).scaleFactor;
+	} catch(const std::out_of_range &) {
+	  throw(std::runtime_error("No NEUEVWAV header for stim electrode " + std::to_string(e)));
+	}
+
+	slot[e] = scales.size();
+	scales.push_back(s);
+      }
+      return scales[slot[e]];
+    }
+
+    template <typename T>
+    void streamColumn(MATFile &m, const std::string &name, Spool &src, const MW::mwSize* dims) {
+      auto out = m.openArray<T>(name, 2, dims);
+      src.replay<T>([&out](const T* v, std::size_t k) { out.append(v, k); });
+      out.close();
+    }
+
+    /* Reads the waveforms back in file order, a chunk of events at a time,
+       with each one's electrode (for its scale) and length alongside. Within
+       a chunk, each electrode's waveforms are gathered and converted in one
+       batch, then put back in event order. */
+    void writeWaveforms(MATFile &m) {
+      const std::size_t CHUNK = 4096;  // Events per chunk
+      MW::mwSize wdims[2] = { static_cast<MW::mwSize>(nSamples), static_cast<MW::mwSize>(n) };
+      auto out = m.openArray<double>("waveform", 2, wdims);
+
+      std::vector<std::uint16_t> electrodes(CHUNK);
+      std::vector<std::uint32_t> lengths(CHUNK);
+      std::vector<std::size_t> offsets(CHUNK);     // Of each event's samples in raw
+      std::vector<std::size_t> order(CHUNK);       // Chunk sorted by electrode
+      std::vector<char> raw;
+      std::vector<char> packed;                    // One electrode's waveforms, padded
+      std::vector<std::uint32_t> packedLengths;
+      std::vector<double> decoded;
+      std::vector<double> buffer(CHUNK * nSamples);
+
+      electrode.seek(0);
+      waveLength.seek(0);
+      waves.seek(0);
+      for(std::size_t done = 0; done < n; ) {
+	const std::size_t k = std::min(CHUNK, n - done);
+	electrode.read(electrodes.data(), k * sizeof(std::uint16_t));
+	waveLength.read(lengths.data(), k * sizeof(std::uint32_t));
+
+	std::size_t bytes = 0;
+	for(std::size_t j = 0; j < k; j++) {
+	  offsets[j] = bytes;
+	  bytes += std::size_t(lengths[j]) * scales[slot[electrodes[j]]].bytesPerSample;
+	}
+	raw.resize(bytes);
+	if(waves.read(raw.data(), bytes) != bytes)
+	  throw(std::runtime_error("Stim waveforms were cut short in the temporary file"));
+
+	for(std::size_t j = 0; j < k; j++)
+	  order[j] = j;
+	std::stable_sort(order.begin(), order.begin() + k,
+			 [&electrodes](std::size_t x, std::size_t y) { return electrodes[x] < electrodes[y]; });
+
+	for(std::size_t first = 0; first < k; ) {
+	  const std::uint16_t id = electrodes[order[first]];
+	  std::size_t last = first;
+	  while(last < k && electrodes[order[last]] == id)
+	    last++;
+
+	  const ElectrodeScale &e = scales[slot[id]];
+	  const std::size_t stride = nSamples * e.bytesPerSample;
+	  const std::size_t count = last - first;
+	  packed.resize(count * stride);
+	  packedLengths.resize(count);
+	  for(std::size_t i = 0; i < count; i++) {
+	    const std::size_t j = order[first + i];
+	    std::memcpy(packed.data() + i * stride, raw.data() + offsets[j],
+			std::size_t(lengths[j]) * e.bytesPerSample);
+	    packedLengths[i] = lengths[j];
+	  }
+
+	  decoded.resize(count * nSamples);
+	  decodeWaveforms(packed.data(), packedLengths.data(), count, e.bytesPerSample, e.scale,
+			  nSamples, decoded.data());
+	  for(std::size_t i = 0; i < count; i++)
+	    std::copy_n(decoded.data() + i * nSamples, nSamples, buffer.data() + order[first + i] * nSamples);
+	  first = last;
+	}
+
+	out.append(buffer.data(), k * nSamples);
+	done += k;
+      }
+      out.close();
+    }
+
+    const NEVConfig &config;
+    const NEVFile &f;
+    std::vector<std::size_t> slot;
+    std::vector<ElectrodeScale> scales;
+
+    std::size_t n;
+    std::size_t nSamples;    // Longest waveform
+    Spool ts;                // uint32
+    Spool electrode;         // uint16
+    Spool waveLength;        // uint32, in samples
+    Spool waves;             // Raw samples, back to back
+  };
+}
+
+
+std::unique_ptr<StimWriter> openStimText(const NEVConfig &config, const NEVFile &file) {
+  return std::unique_ptr<StimWriter>(new StimText(config, file));
+}
+
+std::unique_ptr<StimWriter> openStimCSV(const NEVConfig &config, const NEVFile &file) {
+  return std::unique_ptr<StimWriter>(new StimCSV(config, file));
+}
+
+std::unique_ptr<StimWriter> openStimMatlab(const NEVConfig &config, const NEVFile &file) {
+  return std::unique_ptr<StimWriter>(new StimMatlab(config, file));
 }
 
 
@@ -2,10 +2,27 @@
 
 #include "datapacket.h"
 
+#include <algorithm>
+#include <exception>
 #include <iostream>
 #include <cstring>
-NEVFile::NEVFile(std::string filename, size_t buffersize) :
-  BUFFERSIZE(buffersize)
+
+#ifdef WINDOWS
+#include "mingw.thread.h"
+#endif
+
+#include <thread>
+
+#ifndef WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+NEVFile::NEVFile(std::string filename, size_t buffersize, bool useMmap) :
+  BUFFERSIZE(buffersize), buffer(nullptr), streamBuffer(nullptr),
+  mapped(nullptr), mappedSize(0), released(0)
 {
 
   this->file.open(filename, std::ios_base::binary);
@@ -20,9 +37,15 @@ NEVFile::NEVFile(std::string filename, size_t buffersize) :
   auto nHeaders = readBasicHeader();
   readExtendedHeaders(nHeaders);
   
+  if(useMmap) {
+    this->file.close();
+    mapFile(filename);
+    return;
+  }
   
-  buffer = new uint8_t[BUFFERSIZE*packetSize];
-  file.read(reinterpret_cast<char*>(buffer), BUFFERSIZE*packetSize);
+  streamBuffer = new uint8_t[BUFFERSIZE*packetSize];
+  buffer = streamBuffer;
+  file.read(reinterpret_cast<char*>(streamBuffer), BUFFERSIZE*packetSize);
   buffer_capacity = file.gcount();
   buffer_pos = 0;
 }
@@ -30,7 +53,63 @@ NEVFile::NEVFile(std::string filename, size_t buffersize) :
 
 NEVFile::~NEVFile() {
   this->file.close();
-  delete [] this->buffer;
+  delete [] this->streamBuffer;
+#ifndef WINDOWS
+  if(mapped)
+    munmap(const_cast<uint8_t*>(mapped), mappedSize);
+#endif
+}
+
+
+void NEVFile::mapFile(const std::string &filename) {
+  /* The data section (from headerSize on) then looks like one huge, already
+     full, read buffer. A torn packet at the very end is ignored. */
+#ifdef WINDOWS
+  throw(std::runtime_error("Memory-mapped NEV files are not supported on Windows"));
+#else
+  int fd = open(filename.c_str(), O_RDONLY);
+  if(fd < 0)
+    throw(std::runtime_error("Cannot open file for reading"));
+
+  struct stat st;
+  if(fstat(fd, &st) != 0) {
+    close(fd);
+    throw(std::runtime_error("Cannot determine size of " + filename));
+  }
+  mappedSize = size_t(st.st_size);
+  if(mappedSize < headerSize) {
+    close(fd);
+    throw(std::runtime_error(filename + " is shorter than its own header"));
+  }
+
+  void* p = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // The mapping keeps its own reference to the file
+  if(p == MAP_FAILED)
+    throw(std::runtime_error("Cannot memory-map " + filename));
+
+  mapped = static_cast<const uint8_t*>(p);
+  madvise(p, mappedSize, MADV_SEQUENTIAL);
+
+  buffer = mapped + headerSize;
+  buffer_capacity = ((mappedSize - headerSize) / packetSize) * packetSize;
+  buffer_pos = 0;
+#endif
+}
+
+void NEVFile::releaseConsumed() {
+  /* Pages that have already been decoded won't be read again, so drop them
+     instead of letting a long file pile up in our resident set */
+#ifndef WINDOWS
+  if(!mapped)
+    return;
+
+  const std::size_t pageSize = std::size_t(sysconf(_SC_PAGESIZE));
+  const std::size_t consumed = std::size_t(buffer + buffer_pos - mapped) / pageSize * pageSize;
+  if(consumed > released) {
+    madvise(const_cast<uint8_t*>(mapped) + released, consumed - released, MADV_DONTNEED);
+    released = consumed;
+  }
+#endif
 }
 
 std::uint32_t NEVFile::readBasicHeader() {
@@ -136,14 +215,19 @@ std::ostream& operator<<(std::ostream& out, const NEVFile& f) {
 }
 
 bool NEVFile::eof() const {
+  if(mapped)
+    return this->buffer_pos == this->buffer_capacity;
   return file.eof() && (this->buffer_pos == this->buffer_capacity);
 }
 
 
 void NEVFile::refillBuffer() {
+  if(mapped)
+    return; // Everything is already "in the buffer"
+
   if(!file.eof()) {    
     try {
-      file.read(reinterpret_cast<char*>(buffer), BUFFERSIZE*packetSize);
+      file.read(reinterpret_cast<char*>(streamBuffer), BUFFERSIZE*packetSize);
     } catch (std::ifstream::failure &e) {
       if(!file.eof())
 	throw(e);
@@ -164,6 +248,30 @@ std::shared_ptr<Packet> NEVFile::readPacket(bool digital, bool stim, bool spike)
 }
 
 
+std::uint16_t NEVFile::currentPacketID() const {
+  std::uint16_t packetID;
+  auto start = buffer + buffer_pos + sizeof(std::uint32_t); // Skip the timestamp
+  std::copy(start, start+sizeof(packetID), reinterpret_cast<char*>(&packetID));
+  return packetID;
+}
+
+
+bool NEVFile::nextIsContinuation() {
+  /* Peeks at the packet at buffer_pos (refilling the buffer if needed) and
+     returns true if it continues the previous packet's waveform. */
+  if(this->buffer_pos == this->buffer_capacity) {
+    refillBuffer();
+    if(this->buffer_pos == this->buffer_capacity)
+      return false; // End of file
+  }
+
+  std::uint32_t timestamp;
+  auto start = buffer + buffer_pos;
+  std::copy(start, start+sizeof(timestamp), reinterpret_cast<char*>(&timestamp));
+  return timestamp == 0xFFFFFFU;
+}
+
+
 std::shared_ptr<Packet> NEVFile::readPacketOrNull(bool keep_digital, bool keep_stim, bool keep_spike) {
   /* Read the next packet.  If the corresponding type (digital, stim,
      or spike) is true, parse it and return a shared_ptr.  Otherwise,
@@ -172,6 +280,7 @@ std::shared_ptr<Packet> NEVFile::readPacketOrNull(bool keep_digital, bool keep_s
      This avoids pointlessly allocating and then deallocating structures, particularly 
      SpikePackets. There are a ton of them,  we're not particularly interested in them 
      and the alloc/dealloc consumes a massive amount of runtime (>30% in the destructors alone).
+     If you want to keep lots of them, visitPackets() is much cheaper.
   */
 
   if(this->eof())
@@ -181,12 +290,7 @@ std::shared_ptr<Packet> NEVFile::readPacketOrNull(bool keep_digital, bool keep_s
     refillBuffer();
   }
   
-  std::uint32_t timestamp;
-  std::uint16_t packetID;
-
-  auto start = buffer + buffer_pos + sizeof(timestamp);
-  std::copy(start, start+sizeof(packetID), reinterpret_cast<char*>(&packetID));
-
+  std::uint16_t packetID = currentPacketID();
   std::shared_ptr<Packet> p = nullptr;
 
   if(packetID == 0 && keep_digital) {
@@ -200,116 +304,414 @@ std::shared_ptr<Packet> NEVFile::readPacketOrNull(bool keep_digital, bool keep_s
   //Peek at the next packet to see if it is a continuation packet
   this->buffer_pos+=this->packetSize;
   
-  while(true) {
-    if(this->buffer_pos == this->buffer_capacity) {
-      if(this->eof())
-	return p; 
-      else
-	refillBuffer();
-    }
-
-    start = buffer + buffer_pos;
-    std::copy(start, start+sizeof(timestamp),
-	      reinterpret_cast<char*>(&timestamp));    
-    if(timestamp != 0xFFFFFFU) //not a continuation packet
-      break;
-
-    if(!p) { // a continuation packet, but we're ignoring it (wrong type)
-      this->buffer_pos += this->packetSize;
-      continue; 
-    } else {
-      
-      auto wavep = std::dynamic_pointer_cast<WavePacket>(p);
+  while(nextIsContinuation()) {
+    auto wavep = std::dynamic_pointer_cast<WavePacket>(p);
+    if(wavep) {
+      auto start = buffer + buffer_pos + sizeof(std::uint32_t); // Skip the 0xFFFFFF marker
     
-      auto   newlen  = wavep->len + this->packetSize - sizeof(timestamp);
+      auto   newlen  = wavep->len + this->packetSize - sizeof(std::uint32_t);
       char*  newdata = new char[newlen];
     
       std::copy(wavep->waveform, wavep->waveform + wavep->len, newdata);
-      std::copy(start, start + this->packetSize - sizeof(timestamp),
+      std::copy(start, start + this->packetSize - sizeof(std::uint32_t),
 		newdata + wavep->len);
 
       delete [] wavep->waveform;
       wavep->waveform = newdata;
       wavep->len      = newlen;
-      buffer_pos += this->packetSize;
     }
+    // Otherwise, it continues a packet we're ignoring (or one without a waveform)
+    buffer_pos += this->packetSize;
   }
 
   return p;	          
 }
 
 
-std::shared_ptr<DigitalPacket> NEVFile::parseCurrentAsDigital() {
-  auto start = buffer + buffer_pos;
-  std::shared_ptr<DigitalPacket> p(new DigitalPacket);
+void NEVFile::skipCurrent() {
+  /* Steps past the current packet and any continuations of it */
+  this->buffer_pos += this->packetSize;
+  while(nextIsContinuation())
+    this->buffer_pos += this->packetSize;
+}
 
-  std::copy(start, start+sizeof(p->timestamp),
-	    reinterpret_cast<char*>(&(p->timestamp)));
 
-  start+=sizeof(p->timestamp) + 2; //+ 2 to skip the packetID
-  
-  DigitalReason reason;
-  std::copy(start, start+sizeof(p->reason), reinterpret_cast<char*>(&reason));
-  p->reason = reason;
-  
-  start+=sizeof(p->reason) + 1;  //Skipping a byte reserved for future use
+const char* NEVFile::finishWaveform(const char* waveform, std::size_t &len) {
+  /* Steps past the current packet, whose waveform starts at waveform, and
+     any continuations of it. Returns the complete waveform: still in the
+     read buffer (or mapping) if it fit in one packet, or reassembled in
+     scratch if it didn't (or if the buffer has to be refilled to find
+     out). scratch is reused, so this only allocates when a waveform is
+     longer than any seen before. */
+  bool copied = false;
+  this->buffer_pos += this->packetSize;
+
+  if(this->buffer_pos == this->buffer_capacity && !mapped) {
+    // Refilling the buffer would overwrite the waveform
+    scratch.assign(waveform, waveform + len);
+    waveform = scratch.data();
+    copied = true;
+  }
 
-  std::copy(start, start+sizeof(p->parallel), reinterpret_cast<char*>(&(p->parallel)));
-  start+=sizeof(p->parallel);
+  while(nextIsContinuation()) {
+    if(!copied) {
+      scratch.assign(waveform, waveform + len);
+      copied = true;
+    }
 
-  std::copy(start, start+sizeof(p->SMA1), reinterpret_cast<char*>(&(p->SMA1)));
-  start+=sizeof(p->SMA1);
-  
-  std::copy(start, start+sizeof(p->SMA2), reinterpret_cast<char*>(&(p->SMA2)));
-  start+=sizeof(p->SMA2);
+    auto start = reinterpret_cast<const char*>(buffer + buffer_pos) + sizeof(std::uint32_t);
+    scratch.insert(scratch.end(), start, start + this->packetSize - sizeof(std::uint32_t));
+    waveform = scratch.data();
+    len = scratch.size();
+    this->buffer_pos += this->packetSize;
+  }
+
+  return waveform;
+}
+
+
+namespace {
+  /* Reads a field of type T, starting at p (which needn't be aligned) */
+  template<typename T>
+  inline T field(const std::uint8_t* p) {
+    T value;
+    std::memcpy(&value, p, sizeof(T));
+    return value;
+  }
+
+
+  /* Decodes packetSize records into the columns of a PacketSOA.
+
+     Packet layouts (byte offsets):
+       all:     0 timestamp (u32), 4 packet ID (u16)
+       digital: 6 reason (u8), 8 parallel (u16), 10-17 SMA 1-4 (i16)
+       spike:   6 unit (u8), 8 waveform
+       stim:    8 waveform
+     A timestamp of 0xFFFFFF marks a continuation of the previous packet's
+     waveform, from byte 4 on. */
+  struct ColumnDecoder {
+    PacketSOA &soa;
+    const std::size_t packetSize;
+    const bool keep_digital, keep_stim, keep_spike;
+    WaveSOA* last; // Gets the next continuation packet (if any)
+
+    ColumnDecoder(PacketSOA &_soa, std::size_t _packetSize,
+		  bool digital, bool stim, bool spike) :
+      soa(_soa), packetSize(_packetSize),
+      keep_digital(digital), keep_stim(stim), keep_spike(spike), last(nullptr) {
+    }
+
+    static bool isContinuation(const std::uint8_t* rec) {
+      return field<std::uint32_t>(rec) == 0xFFFFFFU;
+    }
+
+    void continuation(const std::uint8_t* rec) {
+      if(last) {
+	const std::size_t contLen = packetSize - sizeof(std::uint32_t);
+	const char* start = reinterpret_cast<const char*>(rec) + sizeof(std::uint32_t);
+	last->waveforms.insert(last->waveforms.end(), start, start + contLen);
+	last->len.back() += std::uint32_t(contLen);
+      }
+    }
+
+    // Returns true if the packet was one of the requested types
+    bool decode(const std::uint8_t* rec) {
+      const std::size_t waveLen = packetSize - 8;
+      std::uint32_t timestamp = field<std::uint32_t>(rec);
+      std::uint16_t packetID = field<std::uint16_t>(rec + 4);
+      const char* wave = reinterpret_cast<const char*>(rec) + 8;
+      last = nullptr;
+
+      switch(packetKind(packetID)) {
+      case PacketKind::DIGITAL:
+	if(keep_digital) {
+	  EventSOA &ev = soa.events;
+	  ev.ts.push_back(timestamp);
+	  ev.reason.push_back(static_cast<DigitalReason>(rec[6]));
+	  ev.parallel.push_back(field<std::uint16_t>(rec + 8));
+	  ev.sma1.push_back(field<std::int16_t>(rec + 10));
+	  ev.sma2.push_back(field<std::int16_t>(rec + 12));
+	  ev.sma3.push_back(field<std::int16_t>(rec + 14));
+	  ev.sma4.push_back(field<std::int16_t>(rec + 16));
+	  return true;
+	}
+	break;
+
+      case PacketKind::SPIKE:
+	if(keep_spike) {
+	  SpikeSOA &sp = soa.spikes;
+	  sp.ts.push_back(timestamp);
+	  sp.electrode.push_back(packetID);
+	  sp.unit.push_back(rec[6]);
+	  sp.offset.push_back(sp.waveforms.size());
+	  sp.len.push_back(std::uint32_t(waveLen));
+	  sp.waveforms.insert(sp.waveforms.end(), wave, wave + waveLen);
+	  last = &sp;
+	  return true;
+	}
+	break;
+
+      case PacketKind::STIM:
+	if(keep_stim) {
+	  StimSOA &st = soa.stims;
+	  st.ts.push_back(timestamp);
+	  st.electrode.push_back(std::uint16_t(packetID - STIM_CHANNEL_OFFSET));
+	  st.offset.push_back(st.waveforms.size());
+	  st.len.push_back(std::uint32_t(waveLen));
+	  st.waveforms.insert(st.waveforms.end(), wave, wave + waveLen);
+	  last = &st;
+	  return true;
+	}
+	break;
+      }
+      return false;
+    }
+  };
+
+
+  /* Appends src's rows to dest, shifting the waveform offsets to match */
+  void appendWaves(WaveSOA &dest, const WaveSOA &src) {
+    std::size_t base = dest.waveforms.size();
+    dest.ts.insert(dest.ts.end(), src.ts.begin(), src.ts.end());
+    dest.electrode.insert(dest.electrode.end(), src.electrode.begin(), src.electrode.end());
+    dest.len.insert(dest.len.end(), src.len.begin(), src.len.end());
+    for(auto o : src.offset)
+      dest.offset.push_back(base + o);
+    dest.waveforms.insert(dest.waveforms.end(), src.waveforms.begin(), src.waveforms.end());
+  }
+
+  template<typename T>
+  void appendColumn(std::vector<T> &dest, const std::vector<T> &src) {
+    dest.insert(dest.end(), src.begin(), src.end());
+  }
+
+  void append(PacketSOA &dest, const PacketSOA &src) {
+    appendColumn(dest.events.ts, src.events.ts);
+    appendColumn(dest.events.reason, src.events.reason);
+    appendColumn(dest.events.parallel, src.events.parallel);
+    appendColumn(dest.events.sma1, src.events.sma1);
+    appendColumn(dest.events.sma2, src.events.sma2);
+    appendColumn(dest.events.sma3, src.events.sma3);
+    appendColumn(dest.events.sma4, src.events.sma4);
+
+    appendWaves(dest.spikes, src.spikes);
+    appendColumn(dest.spikes.unit, src.spikes.unit);
+
+    appendWaves(dest.stims, src.stims);
+  }
+}
+
+
+std::size_t NEVFile::readColumns(PacketSOA &soa, std::size_t maxPackets,
+				 bool keep_digital, bool keep_stim, bool keep_spike) {
+  ColumnDecoder decoder(soa, this->packetSize, keep_digital, keep_stim, keep_spike);
+  std::size_t decoded = 0;
+
+  while(!this->eof()) {
+    if(this->buffer_pos == this->buffer_capacity) {
+      refillBuffer();
+      if(this->buffer_pos == this->buffer_capacity)
+	break;
+    }
+
+    const std::uint8_t* rec = buffer + buffer_pos;
+    if(ColumnDecoder::isContinuation(rec)) {
+      decoder.continuation(rec);
+    } else if(decoded == maxPackets) {
+      break;
+    } else if(decoder.decode(rec)) {
+      decoded++;
+    }
 
-  std::copy(start, start+sizeof(p->SMA3), reinterpret_cast<char*>(&(p->SMA3)));
-  start+=sizeof(p->SMA3);
+    this->buffer_pos += this->packetSize;
+  }
+
+  return decoded;
+}
 
-  std::copy(start, start+sizeof(p->SMA4), reinterpret_cast<char*>(&(p->SMA4)));
-  start+=sizeof(p->SMA4);
 
+std::size_t NEVFile::readColumns(PacketSOA &soa, std::size_t maxPackets, unsigned nThreads,
+				 bool keep_digital, bool keep_stim, bool keep_spike) {
+  if(!mapped || nThreads < 2) {
+    std::size_t decoded = readColumns(soa, maxPackets, keep_digital, keep_stim, keep_spike);
+    releaseConsumed();
+    return decoded;
+  }
+
+  for(;;) {
+    /* Split the next maxPackets packets into one contiguous chunk per thread. A
+       chunk skips any continuations at its start, and instead runs past its
+       end to pick up the continuations of its own last packet, so every
+       waveform is decoded whole, by exactly one thread. */
+    const std::size_t nRemaining = (buffer_capacity - buffer_pos) / packetSize;
+    const std::size_t nPackets = std::min(nRemaining, maxPackets);
+    if(nPackets == 0)
+      return 0;
+    nThreads = unsigned(std::max<std::size_t>(1, std::min<std::size_t>(nThreads, nPackets)));
+
+    std::vector<PacketSOA> chunks(nThreads);
+    std::vector<std::size_t> counts(nThreads, 0);
+    std::vector<std::exception_ptr> errors(nThreads);
+
+    auto decodeChunk = [&](unsigned k) {
+      try {
+	const std::uint8_t* data = buffer + buffer_pos;
+	std::size_t first = nPackets * k / nThreads;
+	std::size_t stop  = nPackets * (k + 1) / nThreads;
+
+	ColumnDecoder decoder(chunks[k], packetSize, keep_digital, keep_stim, keep_spike);
+	std::size_t i = first;
+	while(i < stop && ColumnDecoder::isContinuation(data + i * packetSize))
+	  i++;
+
+	for(; i < stop; i++) {
+	  const std::uint8_t* rec = data + i * packetSize;
+	  if(ColumnDecoder::isContinuation(rec))
+	    decoder.continuation(rec);
+	  else if(decoder.decode(rec))
+	    counts[k]++;
+	}
+
+	for(; i < nRemaining && ColumnDecoder::isContinuation(data + i * packetSize); i++)
+	  decoder.continuation(data + i * packetSize);
+      } catch(...) {
+	errors[k] = std::current_exception();
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for(auto k = 1U; k < nThreads; k++)
+      threads.push_back(std::thread(decodeChunk, k));
+    decodeChunk(0);
+    for(auto &t : threads)
+      t.join();
+
+    for(auto &e : errors) {
+      if(e)
+	std::rethrow_exception(e);
+    }
+
+    // Packets are stored in time order, so concatenating the chunks keeps it
+    std::size_t decoded = 0;
+    for(auto k = 0U; k < nThreads; k++) {
+      append(soa, chunks[k]);
+      decoded += counts[k];
+      chunks[k] = PacketSOA(); // Free each chunk as soon as it's merged
+    }
+
+    // The last chunk already took the continuations just past the end
+    buffer_pos += nPackets * packetSize;
+    while(buffer_pos < buffer_capacity && ColumnDecoder::isContinuation(buffer + buffer_pos))
+      buffer_pos += packetSize;
+
+    releaseConsumed();
+
+    // Like readColumns(), only come back empty-handed at the end of the file
+    if(decoded > 0 || eof())
+      return decoded;
+  }
+}
+
+
+std::shared_ptr<DigitalPacket> NEVFile::parseCurrentAsDigital() {
+  std::shared_ptr<DigitalPacket> p(new DigitalPacket);
+  parseCurrentAsDigital(*p);
   return p;
 }
 
 
 std::shared_ptr<SpikePacket> NEVFile::parseCurrentAsSpike() {
-   auto start = buffer + buffer_pos;
+   SpikeView v;
+   parseCurrentAsSpike(v);
+
    std::shared_ptr<SpikePacket> p(new SpikePacket);
+   p->timestamp = v.timestamp;
+   p->electrodeID = v.electrodeID;
+   p->unit = v.unit;
 
-   std::copy(start, start+sizeof(p->timestamp), reinterpret_cast<char*>(&(p->timestamp)));
-   start+=sizeof(p->timestamp);
+   p->waveform = new char[v.len]; //Now managed by SpikePacket
+   p->len = v.len;
+   std::copy(v.waveform, v.waveform + v.len, p->waveform);
 
-   std::copy(start, start+sizeof(p->electrodeID), reinterpret_cast<char*>(&(p->electrodeID)));
-   start+=sizeof(p->electrodeID);
+   return p;
+}
 
-   std::copy(start, start+sizeof(p->unit), reinterpret_cast<char*>(&(p->unit)));
-   start+=sizeof(p->unit) + 1; // Skip reserved byte
 
-   p->waveform = new char[this->packetSize  - 8]; //Now managed by SpikePacket
-   p->len = this->packetSize - 8;
-   std::copy(start, start+this->packetSize-8, p->waveform);
-     
+std::shared_ptr<StimPacket> NEVFile::parseCurrentAsStim() {
+   StimView v;
+   parseCurrentAsStim(v);
+
+   std::shared_ptr<StimPacket> p(new StimPacket);
+   p->timestamp = v.timestamp;
+   p->electrodeID = v.electrodeID;
+
+   p->waveform = new char[v.len]; //Now managed by StimPacket
+   p->len = v.len;
+   std::copy(v.waveform, v.waveform + v.len, p->waveform);
 
    return p;
 }
 
-std::shared_ptr<StimPacket> NEVFile::parseCurrentAsStim() {
-   auto start = buffer + buffer_pos;
-   std::shared_ptr<StimPacket> p(new StimPacket);
 
-   std::copy(start, start+sizeof(p->timestamp), reinterpret_cast<char*>(&(p->timestamp)));
-   start+=sizeof(p->timestamp);
-   std::copy(start, start+sizeof(p->electrodeID), reinterpret_cast<char*>(&(p->electrodeID)));
-   p->electrodeID -= 5120; //Remove offset
-   start+=sizeof(p->electrodeID) + 2;
+void NEVFile::parseCurrentAsDigital(DigitalPacket &p) const {
+  auto start = buffer + buffer_pos;
 
-   p->waveform = new char[this->packetSize  - 8]; //Now managed by StimPacket
-   p->len = this->packetSize - 8;
-   std::copy(start, start+this->packetSize-8, p->waveform);     
+  std::copy(start, start+sizeof(p.timestamp),
+	    reinterpret_cast<char*>(&(p.timestamp)));
 
-   return p;
+  start+=sizeof(p.timestamp) + 2; //+ 2 to skip the packetID
+  
+  DigitalReason reason;
+  std::copy(start, start+sizeof(p.reason), reinterpret_cast<char*>(&reason));
+  p.reason = reason;
+  
+  start+=sizeof(p.reason) + 1;  //Skipping a byte reserved for future use
+
+  std::copy(start, start+sizeof(p.parallel), reinterpret_cast<char*>(&(p.parallel)));
+  start+=sizeof(p.parallel);
+
+  std::copy(start, start+sizeof(p.SMA1), reinterpret_cast<char*>(&(p.SMA1)));
+  start+=sizeof(p.SMA1);
   
+  std::copy(start, start+sizeof(p.SMA2), reinterpret_cast<char*>(&(p.SMA2)));
+  start+=sizeof(p.SMA2);
+
+  std::copy(start, start+sizeof(p.SMA3), reinterpret_cast<char*>(&(p.SMA3)));
+  start+=sizeof(p.SMA3);
+
+  std::copy(start, start+sizeof(p.SMA4), reinterpret_cast<char*>(&(p.SMA4)));
+  start+=sizeof(p.SMA4);
+}
+
+
+void NEVFile::parseCurrentAsSpike(SpikeView &v) const {
+   auto start = buffer + buffer_pos;
+
+   std::copy(start, start+sizeof(v.timestamp), reinterpret_cast<char*>(&(v.timestamp)));
+   start+=sizeof(v.timestamp);
+
+   std::copy(start, start+sizeof(v.electrodeID), reinterpret_cast<char*>(&(v.electrodeID)));
+   start+=sizeof(v.electrodeID);
+
+   std::copy(start, start+sizeof(v.unit), reinterpret_cast<char*>(&(v.unit)));
+   start+=sizeof(v.unit) + 1; // Skip reserved byte
+
+   v.waveform = reinterpret_cast<const char*>(start);
+   v.len = this->packetSize - 8;
+}
+
+
+void NEVFile::parseCurrentAsStim(StimView &v) const {
+   auto start = buffer + buffer_pos;
+
+   std::copy(start, start+sizeof(v.timestamp), reinterpret_cast<char*>(&(v.timestamp)));
+   start+=sizeof(v.timestamp);
+   std::copy(start, start+sizeof(v.electrodeID), reinterpret_cast<char*>(&(v.electrodeID)));
+   v.electrodeID -= STIM_CHANNEL_OFFSET; //Remove offset
+   start+=sizeof(v.electrodeID) + 2;
+
+   v.waveform = reinterpret_cast<const char*>(start);
+   v.len = this->packetSize - 8;
 }
 
 std::ostream& operator<<(std::ostream& out, const DigitalMode& m) {
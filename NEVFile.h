@@ -15,9 +15,24 @@
 #include "systemtime.h"
 #include "extheader.h"
 #include "datapacket.h"
+#include "packetsoa.h"
 
 const uint16_t STIM_CHANNEL_OFFSET = 5120;
 
+/* NEV packet IDs: 0 is a digital event, 1-512 are spikes (the electrode
+   ID), and anything above that is stimulation (5120 + electrode ID). */
+enum class PacketKind : std::uint8_t {
+  DIGITAL,
+  SPIKE,
+  STIM
+};
+
+inline PacketKind packetKind(std::uint16_t packetID) {
+  return packetID == 0 ? PacketKind::DIGITAL :
+         packetID <= 512 ? PacketKind::SPIKE : PacketKind::STIM;
+}
+
+
 enum DigitalMode: std::uint8_t {
   SERIAL_MODE = 0,
   PARALLEL_MODE = 1
@@ -25,14 +40,47 @@ enum DigitalMode: std::uint8_t {
 std::ostream& operator<<(std::ostream& out, const DigitalMode& m);
 
 
+/* With useMmap (POSIX only), the whole file is memory-mapped and the
+   data packets are decoded in place: there is no read buffer to fill, and
+   the waveforms that visitPackets() hands out point straight into the
+   mapping. Only waveforms split across continuation packets are copied. */
 class NEVFile {
 public:
-  NEVFile(std::string filename, size_t BUFFERSIZE=1000);
+  NEVFile(std::string filename, size_t BUFFERSIZE=1000, bool useMmap=false);
   ~NEVFile();
 
   bool eof() const;
+  bool isMapped() const { return mapped != nullptr; }
   std::shared_ptr<Packet> readPacket(bool digital=true, bool stim=true, bool spike=true);
-  
+
+  /* Reads up to maxPackets packets of the requested type(s), calling
+     visit(const DigitalPacket&), visit(const SpikeView&), or
+     visit(const StimView&) on each, and returns the number visited (fewer
+     only at the end of the file). There's no Packet hierarchy involved:
+     dispatch is a switch on the packet ID, and nothing is allocated.
+
+     The views' waveforms point into NEVFile's own buffers, so they are
+     only valid during the call; copy anything you want to keep. */
+  template<typename Visitor>
+  std::size_t visitPackets(Visitor &&visit, std::size_t maxPackets,
+			   bool digital=true, bool stim=true, bool spike=true);
+
+  /* Batch mode: decodes up to maxPackets packets of the requested type(s)
+     straight from the read buffer into the columns of soa (appending to
+     whatever is there), and returns the number decoded. No per-packet
+     objects are made at all. Continuation packets are appended to their
+     waveform, so a batch never ends partway through one. */
+  std::size_t readColumns(PacketSOA &soa, std::size_t maxPackets,
+			  bool digital=true, bool stim=true, bool spike=true);
+
+  /* Same, but a mapped file's next maxPackets packets (of any type) are
+     split into nThreads chunks on packet boundaries, which are decoded at
+     the same time into their own columns and then appended in file (i.e.,
+     time) order. Like the above, it only returns 0 at the end of the file,
+     so call it in a loop to stream through a file with bounded memory. */
+  std::size_t readColumns(PacketSOA &soa, std::size_t maxPackets, unsigned nThreads,
+			  bool digital=true, bool stim=true, bool spike=true);
+
   // Iterators to access spike channel headers
   auto spikeChannels_cbegin() const { return spikeHeaders.cbegin(); }
   auto spikeChannels_cend()   const { return spikeHeaders.cend();   }
@@ -102,19 +150,92 @@ public:
  private:
   //Internal buffer stuff
   const size_t BUFFERSIZE;
-  uint8_t* buffer;
+  const uint8_t* buffer;   // Packets being decoded: streamBuffer, or the mapped data section
+  uint8_t* streamBuffer;   // Filled from file (nullptr when mapped)
   size_t buffer_capacity;
   size_t buffer_pos;
 
+  // Only used when memory-mapped
+  const uint8_t* mapped;
+  size_t mappedSize;
+  size_t released;         // Bytes at the start of the mapping handed back to the OS
+  void mapFile(const std::string &filename);
+  void releaseConsumed();
+  std::vector<char> scratch; // Waveforms split across continuation packets
+
   
   std::uint32_t readBasicHeader();
   void readExtendedHeaders(const std::uint32_t nHeaders);
   void refillBuffer();
+  std::uint16_t currentPacketID() const;
+  bool nextIsContinuation();
+  void skipCurrent();
+  const char* finishWaveform(const char* waveform, std::size_t &len);
 
   std::shared_ptr<DigitalPacket> parseCurrentAsDigital();
   std::shared_ptr<SpikePacket>   parseCurrentAsSpike();
   std::shared_ptr<StimPacket>    parseCurrentAsStim();
+
+  // Same, but the views' waveforms point into the read buffer
+  void parseCurrentAsDigital(DigitalPacket &p) const;
+  void parseCurrentAsSpike(SpikeView &v) const;
+  void parseCurrentAsStim(StimView &v) const;
   
 };
 
+
+template<typename Visitor>
+std::size_t NEVFile::visitPackets(Visitor &&visit, std::size_t maxPackets,
+				  bool keep_digital, bool keep_stim, bool keep_spike) {
+  std::size_t visited = 0;
+  
+  while(visited < maxPackets && !this->eof()) {
+    if(this->buffer_capacity == this->buffer_pos) {
+      refillBuffer();
+      if(this->buffer_capacity == this->buffer_pos)
+	break;
+    }
+
+    switch(packetKind(currentPacketID())) {
+    case PacketKind::DIGITAL:
+      if(keep_digital) {
+	DigitalPacket p;
+	parseCurrentAsDigital(p);
+	skipCurrent();
+	visit(static_cast<const DigitalPacket&>(p));
+	visited++;
+      } else {
+	skipCurrent();
+      }
+      break;
+      
+    case PacketKind::SPIKE:
+      if(keep_spike) {
+	SpikeView v;
+	parseCurrentAsSpike(v);
+	v.waveform = finishWaveform(v.waveform, v.len);
+	visit(static_cast<const SpikeView&>(v));
+	visited++;
+      } else {
+	skipCurrent();
+      }
+      break;
+      
+    case PacketKind::STIM:
+      if(keep_stim) {
+	StimView v;
+	parseCurrentAsStim(v);
+	v.waveform = finishWaveform(v.waveform, v.len);
+	visit(static_cast<const StimView&>(v));
+	visited++;
+      } else {
+	skipCurrent();
+      }
+      break;
+    }
+  }
+  
+  return visited;
+}
+
 #endif
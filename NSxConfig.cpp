@@ -1,5 +1,8 @@
 #include "NSxConfig.h"
 
+#include <algorithm>
+#include <utility>
+
 
 NSxConfig::NSxConfig(void) : _valid(false), desc("Convert a Ripple NSx file to losslessly-compressed FLAC files") {
   desc.add_options()
@@ -15,10 +18,16 @@ NSxConfig::NSxConfig(void) : _valid(false), desc("Convert a Ripple NSx file to l
          "The converted FLAC filenames start with this, followed by the channel number")
     ("threads", 
          opts::value<unsigned>()->default_value(1), 
-         "Number of threads to use for compression")
+         "Number of threads to use for compression. In directory mode, this is shared by all files being converted at once")
+    ("parallel-files",
+         opts::value<unsigned>()->default_value(0),
+         "In directory mode, convert this many files at once. 0 picks as many as --threads allows")
     ("read-size", 
          opts::value<unsigned>()->default_value(60000),
          "Maximum number of samples to read at once")
+    ("prefetch-blocks",
+         opts::value<unsigned>()->default_value(2),
+         "Number of blocks to read ahead of the encoders. 0 reads and encodes in turn")
     ("flac-compression", 
          opts::value<unsigned>()->default_value(8), 
          "FLAC compression level")
@@ -31,6 +40,19 @@ NSxConfig::NSxConfig(void) : _valid(false), desc("Convert a Ripple NSx file to l
     ("compress-data",
          opts::value<bool>()->default_value(true),
          "Compress the data in the NSx file?")
+    ("mmap",
+#ifdef WINDOWS
+         opts::value<bool>()->default_value(false),
+#else
+         opts::value<bool>()->default_value(true),
+#endif
+         "Memory-map the NSx file instead of reading it through a stream (not available on Windows)")
+    ("index-file",
+         opts::value<bool>()->default_value(false),
+         "Keep the NSx file's packet index in a .idx file next to it, and reuse it on later runs")
+    ("channels",
+         opts::value<std::string>()->default_value(""),
+         "Only convert these channels: a comma-separated list of numeric IDs, ranges (1-16), labels, or Ripple IDs (A-1-5). Empty converts every channel")
   ;
 
   pos.add("input", 1);
@@ -55,6 +77,22 @@ unsigned int NSxConfig::readSize(void) const {
 }
 
 
+unsigned int NSxConfig::prefetchBlocks(void) const {
+  if(_valid)
+    return _prefetchBlocks;
+  else
+    throw(std::runtime_error("Options not initalized"));
+}
+
+
+unsigned int NSxConfig::parallelFiles(void) const {
+  if(_valid)
+    return _parallelFiles;
+  else
+    throw(std::runtime_error("Options not initalized"));
+}
+
+
 unsigned int NSxConfig::flacCompression(void) const {
   if(_valid)
     return _flacCompression;
@@ -109,6 +147,27 @@ bool NSxConfig::compressData(void) const {
         throw(std::runtime_error("Options not initalized"));
 }
 
+bool NSxConfig::useMmap(void) const {
+    if(_valid)
+        return _useMmap;
+    else
+        throw(std::runtime_error("Options not initalized"));
+}
+
+bool NSxConfig::useIndexFile(void) const {
+    if(_valid)
+        return _useIndexFile;
+    else
+        throw(std::runtime_error("Options not initalized"));
+}
+
+std::vector<std::string> NSxConfig::channels(void) const {
+    if(_valid)
+        return _channels;
+    else
+        throw(std::runtime_error("Options not initalized"));
+}
+
 void NSxConfig::parse(int argc, char* argv[]) {
 
   opts::variables_map vm;
@@ -142,10 +201,15 @@ void NSxConfig::parse(int argc, char* argv[]) {
     
   _nThreads = vm["threads"].as<unsigned>();
   _readSize = vm["read-size"].as<unsigned>();
+  _prefetchBlocks = vm["prefetch-blocks"].as<unsigned>();
+  _parallelFiles = vm["parallel-files"].as<unsigned>();
   _flacCompression = vm["flac-compression"].as<unsigned>();
   _matlabHeader = vm["matlab-header"].as<bool>();
   _textHeader = vm["text-header"].as<bool>();
   _compressData = vm["compress-data"].as<bool>();
+  _useMmap = vm["mmap"].as<bool>();
+  _useIndexFile = vm["index-file"].as<bool>();
+  setChannels(vm);
     
   _valid = true;
 }
@@ -172,6 +236,23 @@ void NSxConfig::setInput(const opts::variables_map& vm) {
 
 
 
+void NSxConfig::setChannels(const opts::variables_map& vm) {
+  /* The names are only checked against the file's channels when it's
+     opened, since each file in a directory may have its own. */
+  _channels.clear();
+
+  std::istringstream list(vm["channels"].as<std::string>());
+  std::string item;
+  while(std::getline(list, item, ',')) {
+    auto first = item.find_first_not_of(" \t");
+    if(first == std::string::npos)
+      continue;
+    auto last = item.find_last_not_of(" \t");
+    _channels.push_back(item.substr(first, last - first + 1));
+  }
+}
+
+
 void NSxConfig::setOutputDir(const opts::variables_map& vm) {
   this->_outputDir = vm["output-dir"].as<std::string>();
   this->outputPath = fs::path(this->_outputDir);
@@ -247,37 +328,59 @@ WorkQueue NSxConfig::toWorkQueue() {
       NSx files inside it. We want to extract inputDir/a.ns5 -->
       outputDir/a/, inputDir/b.ns5 --> outputDir/b/, and so on */
 
-  fs::directory_iterator input_iter(_input);
   fs::directory_iterator end_of_dir; //Default ctor --> special "end" value
 
+  /* Each file is stat'ed once, here. One that can't be (e.g., a dangling
+     symlink) sorts last as size 0, and reports its error when it's opened. */
+  std::vector<std::pair<std::uintmax_t, fs::path> > inputs;
   for(fs::directory_iterator i(_input); i!=end_of_dir; ++i) {
     fs::path p  = i->path();
     if((fs::is_regular_file(p) || fs::is_symlink(p)) && p.extension() == ".ns5") {
-      NSxConfig fileConfig(*this);
+      boost::system::error_code ec;
+      std::uintmax_t size = fs::file_size(p, ec);
+      inputs.push_back(std::make_pair(ec ? 0 : size, p));
+    }
+  }
 
-      fileConfig._input = p.string();
+  /* Start with the biggest files, so that a long file isn't left running
+     on its own at the end while everyone else sits idle. */
+  std::stable_sort(inputs.begin(), inputs.end(),
+		   [](const std::pair<std::uintmax_t, fs::path> &a,
+		      const std::pair<std::uintmax_t, fs::path> &b) {
+		     return a.first > b.first;
+		   });
 
+  for(const auto &input: inputs) {
+    const fs::path &p = input.second;
+    NSxConfig fileConfig(*this);
 
-      fs::path out = this->outputPath / p.stem();
-      fileConfig.setOutputDir(out);
+    fileConfig._input = p.string();
 
-      fileConfig._singleFile = true;
+    fs::path out = this->outputPath / p.stem();
+    fileConfig.setOutputDir(out);
 
-      if(fileConfig.outputPrefix().empty()) {
-	fs::path p(fileConfig._input);
-	std::string f = p.filename().string();      
-	auto loc = f.find_last_of(".");      
-	fileConfig._outputPrefix = f.substr(0, loc) + "_ch";
-      }
+    fileConfig._singleFile = true;
 
-      work.push_back(fileConfig);
+    if(fileConfig.outputPrefix().empty()) {
+      std::string f = p.filename().string();      
+      auto loc = f.find_last_of(".");      
+      fileConfig._outputPrefix = f.substr(0, loc) + "_ch";
     }
+
+    work.push_back(fileConfig);
   }
   
   return work;
 }
 
 
+NSxConfig NSxConfig::withThreads(unsigned nThreads) const {
+  NSxConfig c(*this);
+  c._nThreads = nThreads;
+  return c;
+}
+
+
 std::ostream& operator<<(std::ostream &out, const NSxConfig &c) {
   out << "Ripple-To-FLac Conversation Configuration: " << std::endl <<
     "\t Input: " << c._input << std::endl <<
@@ -287,11 +390,23 @@ std::ostream& operator<<(std::ostream &out, const NSxConfig &c) {
     "\t Writing Matlab header: " << (c._matlabHeader ? "Yes" : "No") << std::endl <<
     "\t Writing text header: " << (c._textHeader ? "Yes" : "No") << std::endl <<
     "\t Writing compressed data: " << (c._compressData ? "Yes": "No") << std::endl <<
+    "\t Memory-mapped input: " << (c._useMmap ? "Yes": "No") << std::endl <<
+    "\t Packet index file: " << (c._useIndexFile ? "Yes": "No") << std::endl <<
+    "\t Channels: ";
+  if(c._channels.empty()) {
+    out << "All";
+  } else {
+    for(auto i = 0U; i < c._channels.size(); i++)
+      out << (i ? ", " : "") << c._channels[i];
+  }
+  out << std::endl <<
     std::endl <<
     "\t Output Prefix: " << c._outputPrefix << std::endl <<
     "\t Compression level: " << c._flacCompression << std::endl <<
     "\t # of threads: " <<  c._nThreads << std::endl <<
+    "\t Files converted at once: " << (c._parallelFiles ? std::to_string(c._parallelFiles) : "Auto") << std::endl <<
     "\t I/O Block Size: " << c._readSize << std::endl <<
+    "\t Blocks read ahead: " << c._prefetchBlocks << std::endl <<
     std::endl;
 
   if(c._singleFile) {
@@ -8,6 +8,7 @@
 #include <sstream>
 #include <string>
 #include <cstdint>
+#include <vector>
 
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
@@ -30,11 +31,16 @@ class NSxConfig {
 
     unsigned int nThreads(void) const;
     unsigned int readSize(void) const;
+    unsigned int prefetchBlocks(void) const;
+    unsigned int parallelFiles(void) const;
     unsigned int flacCompression(void) const;
   
     bool matlabHeader(void) const;
     bool textHeader(void) const;
     bool compressData(void) const;
+    bool useMmap(void) const;
+    bool useIndexFile(void) const;
+    std::vector<std::string> channels(void) const;
     
     std::string outputFilename(std::uint16_t electrode, bool withPath=true) const;
     std::string matlabHeaderFilename() const;
@@ -45,6 +51,7 @@ class NSxConfig {
 
     friend std::ostream& operator<<(std::ostream &out, const NSxConfig &c);
     WorkQueue toWorkQueue();
+    NSxConfig withThreads(unsigned nThreads) const;
     
  private:
     bool _valid;
@@ -60,15 +67,21 @@ class NSxConfig {
     fs::path outputPath;
     unsigned _nThreads;
     unsigned _readSize;
+    unsigned _prefetchBlocks;
+    unsigned _parallelFiles;
     unsigned _flacCompression;
     
     bool     _matlabHeader;
     bool     _textHeader;
     bool     _compressData;
+    bool     _useMmap;
+    bool     _useIndexFile;
+    std::vector<std::string> _channels;
     
     void setInput(const opts::variables_map& vm);
     void setOutputDir(const opts::variables_map& vm);
     void setOutputDir(const fs::path &p);
+    void setChannels(const opts::variables_map& vm);
 };
 
 
@@ -1,7 +1,20 @@
 #include "NSxFile.h"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
 #include <stdexcept>
 
-NSxFile::NSxFile(const std::string& filename) {
+#ifndef WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+NSxFile::NSxFile(const std::string& filename, bool useMmap, bool useIndexFile) :
+  dataStart(0), indexed(false), sampleCount(0),
+  filename(filename), useIndexFile(useIndexFile),
+  mapped(nullptr), mappedSize(0), mappedPos(0), randomAccess(false) {
     
     file.open(filename, std::ios_base::binary | std::ios_base::binary);
     file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
@@ -14,14 +27,384 @@ NSxFile::NSxFile(const std::string& filename) {
         channels.push_back(NSxChannel(file));
     }
     dataAvailable = true; 
+    dataStart = std::uint64_t(file.tellg());
+
+    if(useMmap) {
+        file.close();
+        mapFile(filename);
+    } else if(useIndexFile) {
+        // The stream backend otherwise waits for readRange(), which may never come
+        indexPackets();
+    }
+
+    currentPacket = 0;
+    samplesRemainingInPacket = 0;
     prepareNextPacket();
    
 }
 
+
+NSxFile::~NSxFile() {
+#ifndef WINDOWS
+    if(mapped)
+        munmap(const_cast<char*>(mapped), mappedSize);
+#endif
+}
+
+
+void NSxFile::mapFile(const std::string& filename) {
+#ifdef WINDOWS
+    throw(std::runtime_error("Memory-mapped NSx files are not supported on Windows"));
+#else
+    int fd = open(filename.c_str(), O_RDONLY);
+    if(fd < 0)
+        throw(std::runtime_error("Cannot open file for reading"));
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        throw(std::runtime_error("Cannot determine size of " + filename));
+    }
+    mappedSize = std::uint64_t(st.st_size);
+
+    void* p = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps its own reference to the file
+    if(p == MAP_FAILED)
+        throw(std::runtime_error("Cannot memory-map " + filename));
+
+    mapped = static_cast<const char*>(p);
+    madvise(p, mappedSize, MADV_SEQUENTIAL);
+
+    indexPackets();
+#endif
+}
+
+
+void NSxFile::adviseRange(std::uint64_t offset, std::uint64_t len) {
+    /* The mapping starts out MADV_SEQUENTIAL, for readView(), which makes
+       the kernel read ahead of the last access and drop the pages behind
+       it; both are wrong for windows scattered around the file. The first
+       readRange() switches the whole mapping to MADV_RANDOM, and each
+       window's pages are then requested up front. */
+#ifndef WINDOWS
+    if(!randomAccess) {
+        madvise(const_cast<char*>(mapped), mappedSize, MADV_RANDOM);
+        randomAccess = true;
+    }
+
+    const std::uint64_t page = std::uint64_t(sysconf(_SC_PAGESIZE));
+    const std::uint64_t first = offset / page * page;
+    madvise(const_cast<char*>(mapped) + first, offset + len - first, MADV_WILLNEED);
+#endif
+}
+
+
+void NSxFile::indexPackets() {
+    if(useIndexFile && loadIndexFile())
+        return;
+
+    scanPackets();
+
+    if(useIndexFile)
+        saveIndexFile();
+}
+
+
+namespace {
+    /* Sidecar index layout (native byte order, like the NSx file itself):
+         magic, fingerprint (recording size, mtime, data offset, channel
+         count), packet count, then (offset, timestamp, nSamples) per packet. */
+    const char IDX_MAGIC[8] = {'N', 'S', 'X', 'I', 'D', 'X', '0', '1'};
+
+    /* Each data packet starts with a header byte (0x01), a timestamp and a sample count */
+    const std::uint64_t PACKET_HEADER_SIZE = sizeof(std::uint8_t) + sizeof(std::uint32_t) + sizeof(std::uint32_t);
+
+    struct IndexFingerprint {
+        std::uint64_t fileSize;
+        std::int64_t  mtime;
+        std::uint64_t dataStart;
+        std::uint32_t channelCount;
+
+        bool operator==(const IndexFingerprint &rhs) const {
+            return fileSize == rhs.fileSize && mtime == rhs.mtime &&
+                dataStart == rhs.dataStart && channelCount == rhs.channelCount;
+        }
+    };
+
+    template <typename T>
+    bool readValue(std::istream &in, T &value) {
+        return bool(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+    }
+
+    template <typename T>
+    void writeValue(std::ostream &out, const T &value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+}
+
+
+bool NSxFile::loadIndexFile() {
+    /* Returns false, leaving the index alone, if there is no sidecar or it
+       is stale or damaged; the caller then scans the recording instead. */
+    try {
+        IndexFingerprint expected = {fs::file_size(filename),
+                                     std::int64_t(fs::last_write_time(filename)),
+                                     dataStart, header.getChannelCount()};
+
+        std::ifstream in(filename + ".idx", std::ios_base::binary);
+        if(!in)
+            return false;
+
+        char magic[sizeof(IDX_MAGIC)];
+        IndexFingerprint found;
+        std::uint64_t nPackets;
+        if(!in.read(magic, sizeof(magic)) || std::memcmp(magic, IDX_MAGIC, sizeof(magic)) != 0)
+            return false;
+        if(!readValue(in, found.fileSize) || !readValue(in, found.mtime) ||
+           !readValue(in, found.dataStart) || !readValue(in, found.channelCount) ||
+           !(found == expected))
+            return false;
+        if(!readValue(in, nPackets) || nPackets > expected.fileSize)
+            return false;
+
+        /* Packets have to follow one another, each after its own header,
+           and stay within the data section of the recording */
+        const std::uint64_t bytesPerSample = header.getChannelCount() * sizeof(std::int16_t);
+        std::vector<NSxPacket> loaded(nPackets);
+        std::uint64_t total = 0;
+        std::uint64_t nextHeader = dataStart;
+        for(auto &p: loaded) {
+            if(!readValue(in, p.offset) || !readValue(in, p.timestamp) || !readValue(in, p.nSamples))
+                return false;
+            if(p.offset < nextHeader + PACKET_HEADER_SIZE || p.offset > expected.fileSize ||
+               p.nSamples * bytesPerSample > expected.fileSize - p.offset)
+                return false;
+            p.firstSample = total;
+            total += p.nSamples;
+            nextHeader = p.offset + p.nSamples * bytesPerSample;
+        }
+
+        packets.swap(loaded);
+        sampleCount = total;
+        indexed = true;
+        return true;
+    } catch(std::exception &e) {
+        return false;
+    }
+}
+
+
+void NSxFile::saveIndexFile() const {
+    /* Best-effort: the recording may well live on a read-only share. The
+       index is written under a temporary name and renamed into place, so a
+       reader never sees half of one. */
+    std::string idxName = filename + ".idx";
+    std::string tmpName = idxName + ".tmp";
+    try {
+        IndexFingerprint fp = {fs::file_size(filename),
+                               std::int64_t(fs::last_write_time(filename)),
+                               dataStart, header.getChannelCount()};
+        {
+            std::ofstream out(tmpName, std::ios_base::binary | std::ios_base::trunc);
+            if(!out)
+                return;
+
+            out.write(IDX_MAGIC, sizeof(IDX_MAGIC));
+            writeValue(out, fp.fileSize);
+            writeValue(out, fp.mtime);
+            writeValue(out, fp.dataStart);
+            writeValue(out, fp.channelCount);
+            writeValue(out, std::uint64_t(packets.size()));
+            for(const auto &p: packets) {
+                writeValue(out, p.offset);
+                writeValue(out, p.timestamp);
+                writeValue(out, p.nSamples);
+            }
+            if(!out.flush())
+                throw(std::runtime_error("Cannot write " + tmpName));
+        }
+        fs::rename(tmpName, idxName);
+    } catch(std::exception &e) {
+        boost::system::error_code ignored;
+        fs::remove(tmpName, ignored);
+    }
+}
+
+
+void NSxFile::scanPackets() {
+    /* Hop from packet header to packet header using the sample counts. This
+       only touches the pages holding the headers, not the samples themselves.
+       A truncated final packet is trimmed to the samples that are present. */
+    const std::uint64_t bytesPerSample = header.getChannelCount() * sizeof(std::int16_t);
+
+    std::uint64_t fileSize = mappedSize;
+    std::streampos resumeAt = -1;
+    if(!mapped) {
+        if(dataAvailable)
+            resumeAt = file.tellg();
+        file.clear();
+        file.seekg(0, std::ios_base::end);
+        fileSize = std::uint64_t(file.tellg());
+    }
+
+    packets.clear();
+    sampleCount = 0;
+
+    std::uint64_t pos = dataStart;
+    while(pos + PACKET_HEADER_SIZE <= fileSize) {
+        char raw[PACKET_HEADER_SIZE];
+        readAt(pos, raw, PACKET_HEADER_SIZE);
+        if(raw[0] != 1) {
+            throw(std::runtime_error("Invalid NSx Packet header (should be 1)"));
+        }
+
+        NSxPacket p;
+        std::memcpy(&p.timestamp, raw + 1, sizeof(p.timestamp));
+        std::memcpy(&p.nSamples, raw + 5, sizeof(p.nSamples));
+        p.offset = pos + PACKET_HEADER_SIZE;
+        p.firstSample = sampleCount;
+
+        std::uint64_t available = bytesPerSample ? (fileSize - p.offset) / bytesPerSample : 0;
+        bool truncated = available < p.nSamples;
+        if(truncated)
+            p.nSamples = std::uint32_t(available);
+
+        packets.push_back(p);
+        sampleCount += p.nSamples;
+        if(truncated)
+            break;
+
+        pos = p.offset + p.nSamples * bytesPerSample;
+    }
+
+    // Put the stream back where readData() left it
+    if(resumeAt != std::streampos(-1))
+        file.seekg(resumeAt);
+
+    indexed = true;
+}
+
+
+void NSxFile::readAt(std::uint64_t offset, char* dest, std::uint64_t len) {
+    if(mapped) {
+        std::memcpy(dest, mapped + offset, len);
+    } else {
+        file.seekg(std::streamoff(offset));
+        file.read(dest, std::streamsize(len));
+    }
+}
+
+
+const std::vector<NSxPacket>& NSxFile::getPacketIndex() {
+    if(!indexed)
+        indexPackets();
+    return packets;
+}
+
+
+std::uint64_t NSxFile::getSampleCount() {
+    if(!indexed)
+        indexPackets();
+    return sampleCount;
+}
+
+
+size_t NSxFile::readRange(std::uint64_t sampleStart, std::uint32_t nSamples,
+                          const std::vector<std::uint32_t> &channelSubset, std::int16_t* out) {
+    if(!indexed)
+        indexPackets();
+
+    const std::uint32_t nChannels = header.getChannelCount();
+    for(auto c: channelSubset) {
+        if(c >= nChannels)
+            throw(std::runtime_error("Channel index " + std::to_string(c) + " is out of range"));
+    }
+    const bool allChannels = channelSubset.empty();
+    const std::size_t nOut = allChannels ? nChannels : channelSubset.size();
+    const std::uint64_t bytesPerSample = nChannels * sizeof(std::int16_t);
+
+    if(sampleStart >= sampleCount || nSamples == 0)
+        return 0;
+    std::uint64_t sampleStop = std::min(sampleCount, sampleStart + nSamples);
+
+    // Find the packet holding sampleStart: the last one that starts at or before it
+    auto packet = std::upper_bound(packets.begin(), packets.end(), sampleStart,
+                                   [](std::uint64_t s, const NSxPacket &p) { return s < p.firstSample; });
+    --packet;
+
+    std::streampos resumeAt = -1;
+    if(!mapped) {
+        if(dataAvailable)
+            resumeAt = file.tellg();
+        file.clear();
+    }
+
+    // Rows are pulled through this (stream backend) a chunk at a time
+    const std::uint64_t CHUNK_SAMPLES = 4096;
+    std::vector<std::int16_t> scratch;
+
+    std::uint64_t s = sampleStart;
+    for(; s < sampleStop; ++packet) {
+        std::uint64_t n = std::min<std::uint64_t>(sampleStop, packet->firstSample + packet->nSamples) - s;
+        std::uint64_t offset = packet->offset + (s - packet->firstSample) * bytesPerSample;
+
+        while(n > 0) {
+            std::uint64_t rows = mapped ? n : std::min(n, CHUNK_SAMPLES);
+            // Mapped samples sit at odd addresses (packet headers are 9 bytes), so use memcpy
+            const char* src;
+            if(mapped) {
+                adviseRange(offset, rows * bytesPerSample);
+                src = mapped + offset;
+            } else {
+                scratch.resize(rows * nChannels);
+                readAt(offset, reinterpret_cast<char*>(scratch.data()), rows * bytesPerSample);
+                src = reinterpret_cast<const char*>(scratch.data());
+            }
+
+            std::int16_t* dest = out + (s - sampleStart) * nOut;
+            if(allChannels) {
+                std::memcpy(dest, src, rows * bytesPerSample);
+            } else {
+                for(std::uint64_t r = 0; r < rows; r++, src += bytesPerSample) {
+                    for(std::size_t c = 0; c < nOut; c++)
+                        std::memcpy(dest++, src + channelSubset[c] * sizeof(std::int16_t), sizeof(std::int16_t));
+                }
+            }
+
+            s += rows;
+            n -= rows;
+            offset += rows * bytesPerSample;
+        }
+    }
+
+    if(resumeAt != std::streampos(-1))
+        file.seekg(resumeAt);
+
+    return std::size_t(s - sampleStart);
+}
+
 void NSxFile::prepareNextPacket() {
     
     if(!dataAvailable)
         return;
+
+    if(mapped) {
+        // Skip over any empty packets in the index
+        while(currentPacket < packets.size() && packets[currentPacket].nSamples == 0)
+            currentPacket++;
+
+        if(currentPacket == packets.size()) {
+            dataAvailable = false;
+            samplesRemainingInPacket = 0;
+            return;
+        }
+
+        basetime = packets[currentPacket].timestamp;
+        samplesRemainingInPacket = packets[currentPacket].nSamples;
+        mappedPos = packets[currentPacket].offset;
+        currentPacket++;
+        return;
+    }
     
     // Check to make sure we're actually at a packet boundary.
     std::uint8_t checkval;
@@ -54,6 +437,16 @@ void NSxFile::prepareNextPacket() {
 
 
 size_t NSxFile::readData(std::uint32_t samplesRequested, std::int16_t *&buffer) {
+
+    if(mapped) {
+        const char* view;
+        auto fetchSize = readView(samplesRequested, view);
+        if(!buffer) {
+            buffer = new std::int16_t[fetchSize * header.getChannelCount()];
+        }
+        std::memcpy(buffer, view, fetchSize * header.getChannelCount() * sizeof(std::int16_t));
+        return fetchSize;
+    }
      
     auto fetchSize = std::min(samplesRequested, samplesRemainingInPacket);
     auto totalPoints = fetchSize * header.getChannelCount();
@@ -80,6 +473,29 @@ size_t NSxFile::readData(std::uint32_t samplesRequested, std::int16_t *&buffer)
 
 
 
+size_t NSxFile::readView(std::uint32_t samplesRequested, const char *&view) {
+    /* Points view at the next (up to) samplesRequested interleaved samples,
+       without copying. The view never spans two packets and remains valid
+       for as long as this NSxFile exists. Packet headers are 9 bytes, so the
+       view is usually at an odd address: it's raw bytes, to be read with
+       memcpy or unaligned loads, never through an int16_t pointer. */
+    if(!mapped)
+        throw(std::runtime_error("readView() requires a memory-mapped NSxFile"));
+
+    auto fetchSize = std::min(samplesRequested, samplesRemainingInPacket);
+    view = mapped + mappedPos;
+
+    mappedPos += std::uint64_t(fetchSize) * header.getChannelCount() * sizeof(std::int16_t);
+    samplesRemainingInPacket -= fetchSize;
+
+    if(!samplesRemainingInPacket)
+        prepareNextPacket();
+
+    return fetchSize;
+}
+
+
+
 std::vector<NSxChannel>::const_iterator NSxFile::channelBegin() const {
   return channels.begin();
 }
@@ -91,5 +507,50 @@ std::vector<NSxChannel>::const_iterator NSxFile::channelEnd() const {
 }
 
 
-
-
+std::vector<std::uint32_t> NSxFile::selectChannels(const std::vector<std::string> &selectors) const {
+  /* Each selector is matched against the channels' labels and Ripple IDs
+     first; failing that, a number (or a range like 1-16) is matched
+     against the numeric IDs. */
+  std::vector<bool> wanted(channels.size(), false);
+  
+  for(const std::string &sel : selectors) {
+    bool found = false;
+    for(auto i = 0U; i < channels.size(); i++) {
+      if(channels[i].getLabel() == sel || channels[i].getRippleID() == sel) {
+        wanted[i] = found = true;
+      }
+    }
+    
+    if(!found && !sel.empty() && std::isdigit(static_cast<unsigned char>(sel[0]))) {
+      unsigned long lo, hi;
+      try {
+        std::size_t used, usedHi;
+        lo = hi = std::stoul(sel, &used);
+        if(used < sel.size() && sel[used] == '-') {
+          hi = std::stoul(sel.substr(used + 1), &usedHi);
+          used += 1 + usedHi;
+        }
+        if(used != sel.size())
+          throw(std::invalid_argument(sel));
+      } catch(std::logic_error &) {
+        throw(std::runtime_error("Cannot parse channel selector \"" + sel + "\""));
+      }
+      
+      for(auto i = 0U; i < channels.size(); i++) {
+        auto id = channels[i].getNumericID();
+        if(id >= lo && id <= hi)
+          wanted[i] = found = true;
+      }
+    }
+    
+    if(!found)
+      throw(std::runtime_error("No channel matches \"" + sel + "\""));
+  }
+  
+  std::vector<std::uint32_t> selected;
+  for(auto i = 0U; i < channels.size(); i++) {
+    if(wanted[i])
+      selected.push_back(i);
+  }
+  return selected;
+}
@@ -3,6 +3,23 @@
    this mostly supports reading blocks of samples from the file into
    memory
 
+   Two backends are available. The default streams samples through an
+   ifstream into caller-provided buffers (readData). The mmap backend
+   (POSIX only) maps the whole file, indexes the data packets up front,
+   and hands out pointers straight into the mapping (readView), so the
+   page cache does the buffering and read-ahead.
+
+   Either backend can also fetch an arbitrary window of samples with
+   readRange(). Samples are numbered from 0, across packets, in the
+   order readData() would return them. The packet index this needs is
+   built by hopping between packet headers, so only the headers are
+   read; the stream backend builds it the first time it is needed.
+   With useIndexFile, both backends build the index when the file is
+   opened, and also save it next to the recording (session.ns5 ->
+   session.ns5.idx), to be reloaded on later opens as long as the
+   recording's size and modification time haven't changed and the
+   packets it lists fit in the file.
+
    See also: NSxHeader (contains information about the whole file), and
              NSxChannel (contains information about each channel)
 */
@@ -22,12 +39,34 @@
 #include "MatFile.h"
 #endif
 
+/* Location of one data packet (header byte 0x01, timestamp, sample count) */
+struct NSxPacket {
+    std::uint64_t offset;      // Byte offset of the packet's first sample
+    std::uint64_t firstSample; // Index of the packet's first sample in the whole file
+    std::uint32_t timestamp;   // Timestamp of the packet's first sample
+    std::uint32_t nSamples;    // Samples (per channel) in the packet
+};
+
 class NSxFile {
 public:
-    NSxFile(const std::string& filename);
+    NSxFile(const std::string& filename, bool useMmap=false, bool useIndexFile=false);
+    ~NSxFile();
     
     size_t readData(std::uint32_t nSamples, int16_t* &buffer);
+    size_t readView(std::uint32_t nSamples, const char* &view);
     bool hasMoreData() const { return dataAvailable; }
+    bool isMapped() const { return mapped != nullptr; }
+
+    /* Random access. readRange copies samples [sampleStart, sampleStart +
+       nSamples) of the channels in channelSubset (indices into the channel
+       list; empty means all of them) into out, interleaved in the order
+       given. Windows may span packets. Returns the number of samples
+       copied, which is smaller than nSamples near the end of the file.
+       Doesn't disturb readData()/readView(), but isn't thread-safe. */
+    size_t readRange(std::uint64_t sampleStart, std::uint32_t nSamples,
+                     const std::vector<std::uint32_t> &channelSubset, int16_t* out);
+    std::uint64_t getSampleCount();
+    const std::vector<NSxPacket>& getPacketIndex();
     
     NSxFile(const NSxFile &rhs) = delete;
     NSxFile& operator=(NSxFile & rhs) = delete;
@@ -45,6 +84,11 @@ public:
     std::vector<NSxChannel>::const_iterator channelBegin() const;
     std::vector<NSxChannel>::const_iterator channelEnd() const;
 
+    /* Indices (into the channel list, in file order) of the channels named
+       by selectors: a label, a Ripple ID like "A-1-5", a numeric ID, or a
+       range of numeric IDs like "1-16". Throws if a selector matches nothing. */
+    std::vector<std::uint32_t> selectChannels(const std::vector<std::string> &selectors) const;
+
 protected:
     NSxHeader header;
     std::vector<NSxChannel> channels;
@@ -57,6 +101,32 @@ protected:
     bool dataAvailable;
     
     std::uint32_t basetime;
+
+    // Packet index (always built for mmap, on demand for streams)
+    std::uint64_t dataStart;
+    std::vector<NSxPacket> packets;
+    bool indexed;
+    std::uint64_t sampleCount;
+
+    void indexPackets();
+    void scanPackets();
+    void readAt(std::uint64_t offset, char* dest, std::uint64_t len);
+
+    // Sidecar copy of the packet index
+    std::string filename;
+    bool useIndexFile;
+
+    bool loadIndexFile();
+    void saveIndexFile() const;
+
+    // Only used by the mmap backend
+    const char* mapped;
+    std::uint64_t mappedSize;
+    std::uint64_t mappedPos;
+    bool randomAccess;         // Mapping advised for readRange() rather than readView()
+
+    void mapFile(const std::string& filename);
+    void adviseRange(std::uint64_t offset, std::uint64_t len);
 private:
     
     
@@ -13,6 +13,8 @@
      - DigitalPacket: changes in any of the digital inputs (parallel port + SMA connectors)
      - SpikePacket:   timestamp, channel, online sort, and waveform of a spike
      - StimPacket:    timestamp, channel, and waveform of a microstimulation pulse.
+     - SpikeView/StimView: the same, except the waveform belongs to someone else
+                      (see NEVFile::visitPackets), so they are cheap to copy and never allocate.
 
    NOTES:
      - These could be classes, but there's no point in wrapping everything up with accessors.
@@ -78,6 +80,25 @@ struct StimPacket : WavePacket {
 };
 
 
+/* Non-owning spike and stimulation events. These are plain structs (no
+   vtable, no destructor), so they can be stored by value in big arrays. */
+struct SpikeView {
+  std::uint32_t timestamp;
+  std::uint16_t electrodeID;
+  std::uint8_t unit;
+  const char* waveform;
+  std::size_t len;
+};
+
+
+struct StimView {
+  std::uint32_t timestamp;
+  std::uint16_t electrodeID;
+  const char* waveform;
+  std::size_t len;
+};
+
+
 /***********************************************************************
                     DIGITAL I/O Packets and Types
 ***********************************************************************/
@@ -0,0 +1,205 @@
+#include "deinterleave.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define DEINTERLEAVE_HAVE_SSE2 1
+#endif
+
+#if defined(DEINTERLEAVE_HAVE_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DEINTERLEAVE_HAVE_AVX2 1
+#endif
+
+namespace {
+
+  /* Rows of samples handled per tile. 64 rows of 256 channels is 32 kB of
+     source, which stays in cache while we sweep across the channels. */
+  const std::size_t TILE_SAMPLES = 64;
+
+  typedef void (*tile_kernel)(const char*, std::size_t, std::size_t,
+			      std::size_t, std::size_t, std::size_t,
+			      std::int32_t*, std::size_t);
+
+  /* Each kernel converts samples [s0, s1) of channels [chanStart, chanStop).
+     src is the block's raw bytes, which may start at any address, so the
+     samples are only ever read with memcpy or unaligned loads. */
+  void tile_scalar(const char* src, std::size_t nChannels,
+		   std::size_t s0, std::size_t s1,
+		   std::size_t chanStart, std::size_t chanStop,
+		   std::int32_t* dest, std::size_t destStride) {
+    for(std::size_t c = chanStart; c < chanStop; c++) {
+      std::int32_t* d = dest + (c - chanStart) * destStride;
+      for(std::size_t s = s0; s < s1; s++) {
+	std::int16_t v;
+	std::memcpy(&v, src + (s * nChannels + c) * sizeof(v), sizeof(v));
+	d[s] = std::int32_t(v);
+      }
+    }
+  }
+
+
+#ifdef DEINTERLEAVE_HAVE_SSE2
+  /* Transposes an 8x8 block of int16s held in r[0..7], in place. */
+  inline void transpose8x8(__m128i r[8]) {
+    __m128i t0 = _mm_unpacklo_epi16(r[0], r[1]);
+    __m128i t1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i t2 = _mm_unpacklo_epi16(r[2], r[3]);
+    __m128i t3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i t4 = _mm_unpacklo_epi16(r[4], r[5]);
+    __m128i t5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i t6 = _mm_unpacklo_epi16(r[6], r[7]);
+    __m128i t7 = _mm_unpackhi_epi16(r[6], r[7]);
+
+    __m128i u0 = _mm_unpacklo_epi32(t0, t2);
+    __m128i u1 = _mm_unpackhi_epi32(t0, t2);
+    __m128i u2 = _mm_unpacklo_epi32(t1, t3);
+    __m128i u3 = _mm_unpackhi_epi32(t1, t3);
+    __m128i u4 = _mm_unpacklo_epi32(t4, t6);
+    __m128i u5 = _mm_unpackhi_epi32(t4, t6);
+    __m128i u6 = _mm_unpacklo_epi32(t5, t7);
+    __m128i u7 = _mm_unpackhi_epi32(t5, t7);
+
+    r[0] = _mm_unpacklo_epi64(u0, u4);
+    r[1] = _mm_unpackhi_epi64(u0, u4);
+    r[2] = _mm_unpacklo_epi64(u1, u5);
+    r[3] = _mm_unpackhi_epi64(u1, u5);
+    r[4] = _mm_unpacklo_epi64(u2, u6);
+    r[5] = _mm_unpackhi_epi64(u2, u6);
+    r[6] = _mm_unpacklo_epi64(u3, u7);
+    r[7] = _mm_unpackhi_epi64(u3, u7);
+  }
+
+  inline void load8x8(const char* src, std::size_t nChannels,
+		      std::size_t s, std::size_t c, __m128i r[8]) {
+    for(int k = 0; k < 8; k++)
+      r[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + ((s + k) * nChannels + c) * sizeof(std::int16_t)));
+  }
+
+
+  void tile_sse2(const char* src, std::size_t nChannels,
+		 std::size_t s0, std::size_t s1,
+		 std::size_t chanStart, std::size_t chanStop,
+		 std::int32_t* dest, std::size_t destStride) {
+    std::size_t c = chanStart;
+    std::size_t sEnd = s0 + ((s1 - s0) / 8) * 8;
+
+    for(; c + 8 <= chanStop; c += 8) {
+      std::int32_t* d = dest + (c - chanStart) * destStride;
+      for(std::size_t s = s0; s < sEnd; s += 8) {
+	__m128i r[8];
+	load8x8(src, nChannels, s, c, r);
+	transpose8x8(r);
+
+	// SSE2 has no sign-extending load; duplicate each int16 and shift it down
+	for(int k = 0; k < 8; k++) {
+	  __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(r[k], r[k]), 16);
+	  __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(r[k], r[k]), 16);
+	  _mm_storeu_si128(reinterpret_cast<__m128i*>(d + k * destStride + s), lo);
+	  _mm_storeu_si128(reinterpret_cast<__m128i*>(d + k * destStride + s + 4), hi);
+	}
+      }
+      if(sEnd < s1)
+	tile_scalar(src, nChannels, sEnd, s1, c, c + 8, d, destStride);
+    }
+
+    if(c < chanStop)
+      tile_scalar(src, nChannels, s0, s1, c, chanStop,
+		  dest + (c - chanStart) * destStride, destStride);
+  }
+#endif
+
+
+#ifdef DEINTERLEAVE_HAVE_AVX2
+  __attribute__((target("avx2")))
+  void tile_avx2(const char* src, std::size_t nChannels,
+		 std::size_t s0, std::size_t s1,
+		 std::size_t chanStart, std::size_t chanStop,
+		 std::int32_t* dest, std::size_t destStride) {
+    std::size_t c = chanStart;
+    std::size_t sEnd = s0 + ((s1 - s0) / 8) * 8;
+
+    for(; c + 8 <= chanStop; c += 8) {
+      std::int32_t* d = dest + (c - chanStart) * destStride;
+      for(std::size_t s = s0; s < sEnd; s += 8) {
+	__m128i r[8];
+	load8x8(src, nChannels, s, c, r);
+	transpose8x8(r);
+
+	for(int k = 0; k < 8; k++)
+	  _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + k * destStride + s),
+			      _mm256_cvtepi16_epi32(r[k]));
+      }
+      if(sEnd < s1)
+	tile_scalar(src, nChannels, sEnd, s1, c, c + 8, d, destStride);
+    }
+
+    if(c < chanStop)
+      tile_scalar(src, nChannels, s0, s1, c, chanStop,
+		  dest + (c - chanStart) * destStride, destStride);
+  }
+#endif
+
+
+  struct Kernel {
+    tile_kernel fn;
+    const char* name;
+  };
+
+  Kernel pickKernel() {
+#ifdef DEINTERLEAVE_HAVE_AVX2
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+      return Kernel{tile_avx2, "avx2"};
+#endif
+#ifdef DEINTERLEAVE_HAVE_SSE2
+    return Kernel{tile_sse2, "sse2"};
+#else
+    return Kernel{tile_scalar, "scalar"};
+#endif
+  }
+
+  const Kernel& kernel() {
+    static const Kernel k = pickKernel(); // Thread-safe since C++11
+    return k;
+  }
+}
+
+
+void deinterleave(const char* src, std::size_t nSamples, std::size_t nChannels,
+		  std::size_t chanStart, std::size_t chanStop,
+		  std::int32_t* dest, std::size_t destStride) {
+  tile_kernel fn = kernel().fn;
+  for(std::size_t s0 = 0; s0 < nSamples; s0 += TILE_SAMPLES) {
+    std::size_t s1 = std::min(nSamples, s0 + TILE_SAMPLES);
+    fn(src, nChannels, s0, s1, chanStart, chanStop, dest, destStride);
+  }
+}
+
+
+void deinterleaveColumns(const char* src, std::size_t nSamples, std::size_t nChannels,
+			 const std::uint32_t* columns, std::size_t nColumns,
+			 std::int32_t* dest, std::size_t destStride) {
+  tile_kernel fn = kernel().fn;
+  for(std::size_t s0 = 0; s0 < nSamples; s0 += TILE_SAMPLES) {
+    std::size_t s1 = std::min(nSamples, s0 + TILE_SAMPLES);
+
+    // Split the list into runs of consecutive channels
+    for(std::size_t k = 0; k < nColumns; ) {
+      std::size_t run = 1;
+      while(k + run < nColumns && columns[k + run] == columns[k] + run)
+	run++;
+
+      fn(src, nChannels, s0, s1, columns[k], columns[k] + run,
+	 dest + k * destStride, destStride);
+      k += run;
+    }
+  }
+}
+
+
+const char* deinterleaveKernelName() {
+  return kernel().name;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#ifndef DEINTERLEAVE_H_INCLUDED
+#define DEINTERLEAVE_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+
+/* De-interleaving (transposing) blocks of NSx samples.
+
+   NSx files store samples interleaved: all channels for sample 0, then all
+   channels for sample 1, and so on. FLAC wants one channel at a time, as
+   32-bit integers. deinterleave() converts channels [chanStart, chanStop)
+   of an interleaved block into per-channel planes in a single pass:
+
+      dest[(c - chanStart) * destStride + s] = src[s * nChannels + c]
+
+   The block is walked in small tiles of samples so that each source cache
+   line is only loaded once, regardless of the number of channels. There
+   are SSE2 and AVX2 versions of the inner kernel; the fastest one the CPU
+   supports is picked the first time this is called.
+
+   src is the block's raw bytes (little-endian int16s). It doesn't need to
+   be aligned, and views into a mapped NSx file usually aren't, since NSx
+   packet headers are 9 bytes long.
+*/
+
+void deinterleave(const char* src, std::size_t nSamples, std::size_t nChannels,
+		  std::size_t chanStart, std::size_t chanStop,
+		  std::int32_t* dest, std::size_t destStride);
+
+/* Same, but for an arbitrary list of channels: plane k of dest receives
+   channel columns[k]. Runs of consecutive channels in the list go through
+   the same kernels as above, so an ascending list (e.g., electrodes 1-16)
+   costs about as much as a contiguous range of the same size. Channels
+   that aren't listed are never touched. (It's not an overload of
+   deinterleave(), because a literal 0 for chanStart would be ambiguous
+   with a null columns.) */
+void deinterleaveColumns(const char* src, std::size_t nSamples, std::size_t nChannels,
+			 const std::uint32_t* columns, std::size_t nColumns,
+			 std::int32_t* dest, std::size_t destStride);
+
+/* Name of the kernel deinterleave() dispatches to: "avx2", "sse2", or "scalar" */
+const char* deinterleaveKernelName();
+
+#endif
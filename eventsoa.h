@@ -2,6 +2,9 @@
 #ifndef EVENTSOA_H_INCLUDED
 #define EVENTSOA_H_INCLUDED
 
+#include <memory>
+#include <vector>
+
 #include "datapacket.h"
 
 /* This is a trivial class for converting a stream of digital packets 
@@ -44,14 +47,30 @@ struct EventSOA {
   }
   
   
+  void clear() {
+    ts.clear();
+    reason.clear();
+    parallel.clear();
+    sma1.clear();
+    sma2.clear();
+    sma3.clear();
+    sma4.clear();
+  }
+
+  std::size_t size() const { return ts.size(); }
+  
   void addPacket(std::shared_ptr<DigitalPacket> p) {
-    ts.push_back(p->timestamp);
-    reason.push_back(p->reason);
-    parallel.push_back(p->parallel);
-    sma1.push_back(p->SMA1);
-    sma2.push_back(p->SMA2);
-    sma3.push_back(p->SMA3);
-    sma4.push_back(p->SMA4);
+    addPacket(*p);
+  }
+
+  void addPacket(const DigitalPacket &p) {
+    ts.push_back(p.timestamp);
+    reason.push_back(p.reason);
+    parallel.push_back(p.parallel);
+    sma1.push_back(p.SMA1);
+    sma2.push_back(p.SMA2);
+    sma3.push_back(p.SMA3);
+    sma4.push_back(p.SMA4);
   }
 };
 
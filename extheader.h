@@ -88,13 +88,13 @@ struct SpikeHeader : Header{
   std::uint8_t  nSorted;
 
  SpikeHeader(const NEUEVWAV &n) :
-   
+    Header(n),
     energyThreshold(n.energyThreshold),
     highThreshold(n.highThreshold),
     lowThreshold(n.lowThreshold),
     nSorted(n.nSorted) {
       Header::electrodeID = n.electrodeID;
-      Header::scaleFactor = static_cast<float>(n.neuralScaleFactor) * 1e9F; 
+      Header::scaleFactor = static_cast<float>(n.neuralScaleFactor) * 1e-9F; // nV -> V
     }   
 };
 
@@ -0,0 +1,791 @@
+#include "matv5.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <limits>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+
+namespace MW {
+
+struct mxArray {
+  mxClassID classID;
+  std::vector<mwSize> dims;
+  std::vector<char> data;               // Numeric, logical and char arrays
+
+  std::vector<std::string> fieldnames;  // Struct arrays only. Element i's
+  std::vector<mxArray*> fields;         // fth field is fields[i*nfields + f]
+
+  mwSize numel() const {
+    mwSize n = 1;
+    for(auto d : dims)
+      n *= d;
+    return n;
+  }
+};
+
+}
+
+
+namespace {
+  using namespace MW;
+
+  /* Data types, from the MAT-File Format document */
+  enum : std::uint32_t {
+    miINT8 = 1,
+    miUINT8 = 2,
+    miINT16 = 3,
+    miUINT16 = 4,
+    miINT32 = 5,
+    miUINT32 = 6,
+    miSINGLE = 7,
+    miDOUBLE = 9,
+    miINT64 = 12,
+    miUINT64 = 13,
+    miMATRIX = 14,
+    miCOMPRESSED = 15
+  };
+
+  /* Array flags live in the second byte of the first flags word */
+  const std::uint32_t LOGICAL_FLAG = 0x0200;
+  const std::uint32_t GLOBAL_FLAG  = 0x0400;
+
+  const std::uint64_t MAX_ELEMENT = std::numeric_limits<std::uint32_t>::max();
+
+  /* Struct fields that were never set are written as [] */
+  const mxArray EMPTY_FIELD = { mxDOUBLE_CLASS, {0, 0}, {}, {}, {} };
+
+
+  std::size_t bytesPerElement(mxClassID c) {
+    switch(c) {
+    case mxLOGICAL_CLASS:
+    case mxINT8_CLASS:
+    case mxUINT8_CLASS:
+      return 1;
+    case mxCHAR_CLASS:
+    case mxINT16_CLASS:
+    case mxUINT16_CLASS:
+      return 2;
+    case mxSINGLE_CLASS:
+    case mxINT32_CLASS:
+    case mxUINT32_CLASS:
+      return 4;
+    case mxDOUBLE_CLASS:
+    case mxINT64_CLASS:
+    case mxUINT64_CLASS:
+      return 8;
+    default:
+      return 0;
+    }
+  }
+
+
+  std::uint32_t dataType(mxClassID c) {
+    switch(c) {
+    case mxLOGICAL_CLASS: return miUINT8;
+    case mxCHAR_CLASS:    return miUINT16;
+    case mxDOUBLE_CLASS:  return miDOUBLE;
+    case mxSINGLE_CLASS:  return miSINGLE;
+    case mxINT8_CLASS:    return miINT8;
+    case mxUINT8_CLASS:   return miUINT8;
+    case mxINT16_CLASS:   return miINT16;
+    case mxUINT16_CLASS:  return miUINT16;
+    case mxINT32_CLASS:   return miINT32;
+    case mxUINT32_CLASS:  return miUINT32;
+    case mxINT64_CLASS:   return miINT64;
+    case mxUINT64_CLASS:  return miUINT64;
+    default:              return 0;
+    }
+  }
+
+
+  std::uint32_t arrayFlags(mxClassID c, bool global) {
+    /* Logicals are stored as uint8 arrays with the logical bit set */
+    std::uint32_t flags = (c == mxLOGICAL_CLASS) ? (mxUINT8_CLASS | LOGICAL_FLAG)
+                                                 : static_cast<std::uint32_t>(c);
+    if(global)
+      flags |= GLOBAL_FLAG;
+    return flags;
+  }
+
+
+  std::uint64_t padded(std::uint64_t n) {
+    return (n + 7) & ~static_cast<std::uint64_t>(7);
+  }
+
+
+  /* Size of a data element (tag + padded data) holding n bytes */
+  std::uint64_t elementSize(std::uint64_t n) {
+    return 8 + padded(n);
+  }
+
+
+  std::size_t fieldnameLength(const mxArray* a) {
+    /* Every field name gets the same width, including the terminating NUL */
+    std::size_t len = 1;
+    for(const auto& f : a->fieldnames)
+      len = std::max(len, f.size() + 1);
+    return len;
+  }
+
+
+  /* Size of the array flags, dimensions and name at the start of an miMATRIX */
+  std::uint64_t matrixHeaderSize(std::size_t ndims, std::size_t namelen) {
+    return elementSize(8) + elementSize(4 * ndims) + elementSize(namelen);
+  }
+
+
+  /* Size of an miMATRIX element's data, not counting its own tag */
+  std::uint64_t matrixSize(const mxArray* a, std::size_t namelen) {
+    std::uint64_t n = matrixHeaderSize(a->dims.size(), namelen);
+
+    if(a->classID == mxSTRUCT_CLASS) {
+      n += elementSize(4) + elementSize(a->fieldnames.size() * fieldnameLength(a));
+      for(auto f : a->fields)
+        n += 8 + matrixSize(f ? f : &EMPTY_FIELD, 0);
+    } else {
+      n += elementSize(a->data.size());
+    }
+
+    return n;
+  }
+
+
+  bool dimsFit(const mxArray* a) {
+    for(auto d : a->dims)
+      if(d > static_cast<mwSize>(std::numeric_limits<std::int32_t>::max()))
+	return false;
+    for(auto f : a->fields)
+      if(f && !dimsFit(f))
+	return false;
+    return true;
+  }
+
+
+  /* Sink: where an element goes. Either straight to the file, or through
+     zlib first. Compressed data is written out as soon as zlib produces it,
+     so the whole variable is never buffered. */
+  class Sink {
+  public:
+    Sink(FILE* _fp, bool _compress) :
+      fp(_fp), compress(_compress), ok(true), written(0) {
+      if(compress) {
+	std::memset(&z, 0, sizeof(z));
+	/* Mostly numeric data: the fastest level gives up very little space */
+	ok = (deflateInit(&z, Z_BEST_SPEED) == Z_OK);
+	out.resize(1 << 18);
+      }
+    }
+
+    ~Sink() {
+      if(compress)
+	deflateEnd(&z);
+    }
+
+    Sink(const Sink &rhs) = delete;
+    Sink& operator=(const Sink &rhs) = delete;
+
+    bool write(const void* p, std::size_t n) {
+      if(!ok)
+	return false;
+      if(n == 0)
+	return true;
+
+      if(!compress) {
+	ok = (std::fwrite(p, 1, n, fp) == n);
+	written += n;
+	return ok;
+      }
+
+      /* avail_in is only a uInt, so feed big arrays in pieces */
+      const Bytef* src = static_cast<const Bytef*>(p);
+      while(n > 0 && ok) {
+	uInt chunk = static_cast<uInt>(std::min<std::size_t>(n, 1u << 30));
+	z.next_in = const_cast<Bytef*>(src);
+	z.avail_in = chunk;
+	ok = drain(Z_NO_FLUSH);
+	src += chunk;
+	n -= chunk;
+      }
+      return ok;
+    }
+
+    template <typename T>
+    bool put(T value) {
+      return write(&value, sizeof(T));
+    }
+
+    bool tag(std::uint32_t type, std::uint64_t n) {
+      return put<std::uint32_t>(type) && put<std::uint32_t>(static_cast<std::uint32_t>(n));
+    }
+
+    bool pad(std::uint64_t n) {
+      static const char zeros[8] = {0};
+      return write(zeros, padded(n) - n);
+    }
+
+    bool finish() {
+      if(compress && ok) {
+	z.next_in = nullptr;
+	z.avail_in = 0;
+	ok = drain(Z_FINISH);
+      }
+      return ok && (std::fflush(fp) == 0);
+    }
+
+    std::uint64_t bytesWritten() const { return written; }
+
+  private:
+    FILE* fp;
+    bool compress;
+    bool ok;
+    std::uint64_t written;   // Bytes that reached the file
+    z_stream z;
+    std::vector<Bytef> out;
+
+    bool drain(int flush) {
+      int status;
+      do {
+	z.next_out = out.data();
+	z.avail_out = static_cast<uInt>(out.size());
+	status = deflate(&z, flush);
+	if(status == Z_STREAM_ERROR)
+	  return false;
+
+	std::size_t have = out.size() - z.avail_out;
+	if(std::fwrite(out.data(), 1, have, fp) != have)
+	  return false;
+	written += have;
+      } while(z.avail_out == 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+      return true;
+    }
+  };
+
+
+  /* Writes an miMATRIX tag, followed by the array flags, dimensions and name */
+  bool writeMatrixHeader(Sink& s, std::uint64_t size, mxClassID c, bool global,
+			 const std::vector<mwSize>& dims, const char* name) {
+    std::size_t namelen = std::strlen(name);
+
+    bool ok = s.tag(miMATRIX, size);
+
+    ok = ok && s.tag(miUINT32, 8) && s.put(arrayFlags(c, global)) && s.put<std::uint32_t>(0);
+
+    ok = ok && s.tag(miINT32, 4 * dims.size());
+    for(auto d : dims)
+      ok = ok && s.put(static_cast<std::int32_t>(d));
+    ok = ok && s.pad(4 * dims.size());
+
+    return ok && s.tag(miINT8, namelen) && s.write(name, namelen) && s.pad(namelen);
+  }
+
+
+  bool writeMatrix(Sink& s, const mxArray* a, const char* name, bool global) {
+    bool ok = writeMatrixHeader(s, matrixSize(a, std::strlen(name)), a->classID, global, a->dims, name);
+
+    if(a->classID == mxSTRUCT_CLASS) {
+      std::size_t len = fieldnameLength(a);
+      std::vector<char> names(len * a->fieldnames.size(), 0);
+      for(std::size_t i = 0; i < a->fieldnames.size(); i++)
+	std::memcpy(names.data() + i * len, a->fieldnames[i].data(), a->fieldnames[i].size());
+
+      ok = ok && s.tag(miINT32, 4) && s.put(static_cast<std::int32_t>(len)) && s.put<std::uint32_t>(0);
+      ok = ok && s.tag(miINT8, names.size()) && s.write(names.data(), names.size()) && s.pad(names.size());
+
+      for(auto f : a->fields)
+	ok = ok && writeMatrix(s, f ? f : &EMPTY_FIELD, "", false);
+    } else {
+      ok = ok && s.tag(dataType(a->classID), a->data.size());
+      ok = ok && s.write(a->data.data(), a->data.size()) && s.pad(a->data.size());
+    }
+
+    return ok;
+  }
+
+
+  /* The size of a compressed element isn't known until the end, so its tag
+     starts out as a placeholder that endCompressed() fills in. Compressed
+     elements aren't padded. */
+  bool beginCompressed(FILE* fp, std::fpos_t& tagPos) {
+    std::uint32_t header[2] = { miCOMPRESSED, 0 };
+    return !std::fgetpos(fp, &tagPos) && std::fwrite(header, sizeof(header), 1, fp) == 1;
+  }
+
+
+  bool endCompressed(FILE* fp, const std::fpos_t& tagPos, Sink& s) {
+    if(!s.finish() || s.bytesWritten() > MAX_ELEMENT)
+      return false;
+
+    std::uint32_t header[2] = { miCOMPRESSED, static_cast<std::uint32_t>(s.bytesWritten()) };
+    return !std::fsetpos(fp, &tagPos) &&
+      std::fwrite(header, sizeof(header), 1, fp) == 1 &&
+      !std::fseek(fp, 0, SEEK_END);
+  }
+
+
+  /* The variable being written by matOpenArrayStream(), matWriteArrayStream()
+     and matCloseArrayStream(). If every dimension is known up front, the
+     header can be written immediately, and the data compressed as it
+     arrives. Otherwise, the header has placeholders for the deferred
+     dimension and the sizes, which are filled in when the stream is closed;
+     these variables are never compressed, since that would mean going back
+     into the compressed data. */
+  struct ArrayStream {
+    std::string name;
+    mxClassID classID;
+    std::vector<mwSize> dims;
+    std::size_t deferred;         // Index of the deferred dimension, or dims.size()
+    std::uint64_t expected;       // Data bytes, if nothing is deferred
+    std::uint64_t columnBytes;    // Bytes per step along the deferred dimension
+    std::uint64_t written;        // Data bytes so far
+    bool ok;
+
+    std::fpos_t start;            // Where the miCOMPRESSED or miMATRIX tag is
+    std::unique_ptr<Sink> sink;
+
+    bool isDeferred() const { return deferred < dims.size(); }
+  };
+
+}
+
+
+namespace MW {
+
+struct MATFile {
+  FILE* fp;
+  bool compressed;
+  std::vector<std::string> names;
+  std::unique_ptr<ArrayStream> stream;   // Only one at a time
+};
+
+}
+
+
+namespace {
+
+  int putVariable(MATFile* mfp, const char* name, const mxArray* pa, bool global) {
+    if(!mfp || !name || !pa || mfp->stream)
+      return 1;
+
+    if(!dimsFit(pa) || matrixSize(pa, std::strlen(name)) > MAX_ELEMENT)
+      return 1;
+
+    if(!mfp->compressed) {
+      Sink s(mfp->fp, false);
+      if(!(writeMatrix(s, pa, name, global) && s.finish()))
+	return 1;
+    } else {
+      std::fpos_t tagPos;
+      if(!beginCompressed(mfp->fp, tagPos))
+	return 1;
+
+      Sink s(mfp->fp, true);
+      if(!(writeMatrix(s, pa, name, global) && endCompressed(mfp->fp, tagPos, s)))
+	return 1;
+    }
+
+    mfp->names.push_back(name);
+    return 0;
+  }
+
+
+  template <typename T>
+  bool patch(FILE* fp, const std::fpos_t& start, long offset, T value) {
+    return !std::fsetpos(fp, &start) && !std::fseek(fp, offset, SEEK_CUR) &&
+      std::fwrite(&value, sizeof(T), 1, fp) == 1;
+  }
+
+
+  bool patchDeferred(FILE* fp, const ArrayStream& as) {
+    /* Fills in the matrix size, the deferred dimension and the data size.
+       Offsets are from the miMATRIX tag: the dimensions follow that tag,
+       the array flags and their own tag. */
+    std::uint64_t header = matrixHeaderSize(as.dims.size(), as.name.size());
+    long dimOffset = 8 + 16 + 8 + 4 * static_cast<long>(as.deferred);
+    long dataOffset = 8 + static_cast<long>(header);
+
+    return patch(fp, as.start, 4, static_cast<std::uint32_t>(header + elementSize(as.written))) &&
+      patch(fp, as.start, dimOffset, static_cast<std::int32_t>(as.written / as.columnBytes)) &&
+      patch(fp, as.start, dataOffset + 4, static_cast<std::uint32_t>(as.written)) &&
+      !std::fseek(fp, 0, SEEK_END);
+  }
+
+
+  bool writeHeader(FILE* fp) {
+    char text[116];
+    std::memset(text, ' ', sizeof(text));
+
+    std::time_t now = std::time(nullptr);
+    char when[64] = "";
+    std::strftime(when, sizeof(when), "%a %b %d %H:%M:%S %Y", std::localtime(&now));
+
+    std::string desc = std::string("MATLAB 5.0 MAT-file, written by NSxtract, Created on: ") + when;
+    std::memcpy(text, desc.data(), std::min(desc.size(), sizeof(text)));
+
+    char subsys[8] = {0};
+    std::uint16_t version = 0x0100;
+    std::uint16_t endian = ('M' << 8) | 'I';  // Reads back as "IM" if we're little-endian
+
+    return std::fwrite(text, sizeof(text), 1, fp) == 1 &&
+      std::fwrite(subsys, sizeof(subsys), 1, fp) == 1 &&
+      std::fwrite(&version, sizeof(version), 1, fp) == 1 &&
+      std::fwrite(&endian, sizeof(endian), 1, fp) == 1;
+  }
+
+
+  std::vector<mwSize> makeDims(mwSize ndim, const mwSize* dims) {
+    /* Like MATLAB, keep at least two dimensions and drop trailing singletons */
+    std::vector<mwSize> v(dims, dims + ndim);
+    if(v.empty())
+      v.push_back(0);
+    while(v.size() < 2)
+      v.push_back(1);
+    while(v.size() > 2 && v.back() == 1)
+      v.pop_back();
+    return v;
+  }
+
+
+  mxArray* newArray(mxClassID classID, std::vector<mwSize> dims) {
+    try {
+      mxArray* a = new mxArray;
+      a->classID = classID;
+      a->dims = std::move(dims);
+      try {
+	a->data.resize(a->numel() * bytesPerElement(classID));
+      } catch(...) {
+	delete a;
+	throw;
+      }
+      return a;
+    } catch(const std::bad_alloc&) {
+      return nullptr;
+    } catch(const std::length_error&) {
+      return nullptr;
+    }
+  }
+}
+
+
+namespace MW {
+
+mxArray* mxCreateNumericArray(mwSize ndim, const mwSize* dims, mxClassID classid, mxComplexity flag) {
+  if(flag != mxREAL || bytesPerElement(classid) == 0 || classid == mxCHAR_CLASS)
+    return nullptr;
+  return newArray(classid, makeDims(ndim, dims));
+}
+
+
+mxArray* mxCreateDoubleMatrix(mwSize m, mwSize n, mxComplexity flag) {
+  const mwSize dims[2] = {m, n};
+  return mxCreateNumericArray(2, dims, mxDOUBLE_CLASS, flag);
+}
+
+
+mxArray* mxCreateDoubleScalar(double value) {
+  mxArray* a = mxCreateDoubleMatrix(1, 1, mxREAL);
+  if(a)
+    *mxGetPr(a) = value;
+  return a;
+}
+
+
+mxArray* mxCreateLogicalArray(mwSize ndim, const mwSize* dims) {
+  return newArray(mxLOGICAL_CLASS, makeDims(ndim, dims));
+}
+
+
+mxArray* mxCreateLogicalScalar(bool value) {
+  const mwSize dims[2] = {1, 1};
+  mxArray* a = mxCreateLogicalArray(2, dims);
+  if(a)
+    *static_cast<mxLogical*>(mxGetData(a)) = value;
+  return a;
+}
+
+
+mxArray* mxCreateString(const char* str) {
+  /* Characters are widened one byte at a time, as in MATLAB's default
+     (Latin-1-ish) locale. An empty string is 0x0, like MATLAB's. */
+  std::size_t n = str ? std::strlen(str) : 0;
+  const mwSize dims[2] = { n ? static_cast<mwSize>(1) : 0, n };
+
+  mxArray* a = newArray(mxCHAR_CLASS, makeDims(2, dims));
+  if(a) {
+    mxChar* dst = static_cast<mxChar*>(mxGetData(a));
+    for(std::size_t i = 0; i < n; i++)
+      dst[i] = static_cast<unsigned char>(str[i]);
+  }
+  return a;
+}
+
+
+mxArray* mxCreateStructArray(mwSize ndim, const mwSize* dims, int nfields, const char** fieldnames) {
+  mxArray* a = newArray(mxSTRUCT_CLASS, makeDims(ndim, dims));
+  if(!a)
+    return nullptr;
+
+  try {
+    a->fieldnames.assign(fieldnames, fieldnames + nfields);
+    a->fields.assign(a->numel() * nfields, nullptr);
+  } catch(const std::bad_alloc&) {
+    delete a;
+    return nullptr;
+  }
+  return a;
+}
+
+
+void* mxGetData(const mxArray* pa) {
+  return pa ? const_cast<char*>(pa->data.data()) : nullptr;
+}
+
+
+double* mxGetPr(const mxArray* pa) {
+  return static_cast<double*>(mxGetData(pa));
+}
+
+
+void mxSetFieldByNumber(mxArray* pa, mwIndex i, int fieldnum, mxArray* value) {
+  if(!pa || pa->classID != mxSTRUCT_CLASS || fieldnum < 0)
+    return;
+
+  std::size_t nfields = pa->fieldnames.size();
+  if(static_cast<std::size_t>(fieldnum) < nfields && i < pa->numel())
+    pa->fields[i * nfields + fieldnum] = value;
+}
+
+
+void mxSetField(mxArray* pa, mwIndex i, const char* fieldname, mxArray* value) {
+  if(!pa || !fieldname)
+    return;
+
+  for(std::size_t f = 0; f < pa->fieldnames.size(); f++) {
+    if(pa->fieldnames[f] == fieldname) {
+      mxSetFieldByNumber(pa, i, static_cast<int>(f), value);
+      return;
+    }
+  }
+}
+
+
+void mxDestroyArray(mxArray* pa) {
+  if(!pa)
+    return;
+  for(auto f : pa->fields)
+    mxDestroyArray(f);
+  delete pa;
+}
+
+
+void mxFree(void* ptr) {
+  std::free(ptr);
+}
+
+
+MATFile* matOpen(const char* filename, const char* mode) {
+  /* Only writing is supported; "wL" is the same as "w" since we always
+     write UTF-16 */
+  std::string m(mode ? mode : "");
+  if(!filename || !(m == "w" || m == "wz" || m == "wL"))
+    return nullptr;
+
+  FILE* fp = std::fopen(filename, "wb");
+  if(!fp)
+    return nullptr;
+
+  if(!writeHeader(fp)) {
+    std::fclose(fp);
+    return nullptr;
+  }
+
+  return new MATFile{fp, m == "wz", {}, nullptr};
+}
+
+
+int matClose(MATFile* mfp) {
+  if(!mfp)
+    return EOF;
+
+  int status = mfp->stream ? matCloseArrayStream(mfp) : 0;
+  if(std::fclose(mfp->fp))
+    status = EOF;
+  delete mfp;
+  return status;
+}
+
+
+FILE* matGetFp(MATFile* mfp) {
+  return mfp ? mfp->fp : nullptr;
+}
+
+
+int matPutVariable(MATFile* mfp, const char* name, const mxArray* pa) {
+  return putVariable(mfp, name, pa, false);
+}
+
+
+int matPutVariableAsGlobal(MATFile* mfp, const char* name, const mxArray* pa) {
+  return putVariable(mfp, name, pa, true);
+}
+
+
+int matOpenArrayStream(MATFile* mfp, const char* name, mxClassID classid,
+		       mwSize ndim, const mwSize* dims, mwSize deferred, bool global) {
+  if(!mfp || !name || mfp->stream || bytesPerElement(classid) == 0 || deferred > ndim)
+    return 1;
+
+  std::unique_ptr<ArrayStream> as(new ArrayStream);
+  as->name = name;
+  as->classID = classid;
+  as->dims.assign(dims, dims + ndim);
+  as->deferred = deferred;
+  as->written = 0;
+  as->ok = true;
+
+  /* Dimensions after the deferred one have to be 1, so that appending
+     data only ever adds to the deferred dimension */
+  as->columnBytes = bytesPerElement(classid);
+  for(std::size_t i = 0; i < as->dims.size(); i++) {
+    if(i == as->deferred)
+      continue;
+    if(i > as->deferred && as->dims[i] != 1)
+      return 1;
+    if(as->dims[i] > static_cast<mwSize>(std::numeric_limits<std::int32_t>::max()))
+      return 1;
+    as->columnBytes *= as->dims[i];
+  }
+
+  if(as->isDeferred()) {
+    if(as->columnBytes == 0)
+      return 1;
+    as->dims[as->deferred] = 0;
+  } else {
+    as->dims = makeDims(ndim, dims);
+  }
+  while(as->dims.size() < 2)
+    as->dims.push_back(1);
+
+  as->expected = as->isDeferred() ? 0 : as->columnBytes;
+  std::uint64_t header = matrixHeaderSize(as->dims.size(), as->name.size());
+  if(!as->isDeferred() && header + elementSize(as->expected) > MAX_ELEMENT)
+    return 1;
+
+  bool compress = mfp->compressed && !as->isDeferred();
+  if(compress ? !beginCompressed(mfp->fp, as->start) : std::fgetpos(mfp->fp, &as->start))
+    return 1;
+
+  as->sink.reset(new Sink(mfp->fp, compress));
+  if(!(writeMatrixHeader(*as->sink, header + elementSize(as->expected), classid, global, as->dims, name) &&
+       as->sink->tag(dataType(classid), as->expected)))
+    return 1;
+
+  mfp->stream = std::move(as);
+  return 0;
+}
+
+
+int matWriteArrayStream(MATFile* mfp, const void* data, std::size_t bytes) {
+  if(!mfp || !mfp->stream)
+    return 1;
+
+  ArrayStream& as = *mfp->stream;
+  std::uint64_t total = as.written + bytes;
+  std::uint64_t limit = as.expected;
+  if(as.isDeferred()) {
+    limit = std::min<std::uint64_t>(MAX_ELEMENT - matrixHeaderSize(as.dims.size(), as.name.size()) - 16,
+				    std::numeric_limits<std::int32_t>::max() * as.columnBytes);
+  }
+
+  as.ok = as.ok && total <= limit && as.sink->write(data, bytes);
+  if(as.ok)
+    as.written = total;
+  return as.ok ? 0 : 1;
+}
+
+
+int matCloseArrayStream(MATFile* mfp) {
+  /* Short (or ragged) data is padded with zeros, so the file stays readable
+     even when this reports an error */
+  if(!mfp || !mfp->stream)
+    return 1;
+
+  std::unique_ptr<ArrayStream> as = std::move(mfp->stream);
+  bool complete = as->ok;
+
+  std::uint64_t target = as->isDeferred() ?
+    ((as->written + as->columnBytes - 1) / as->columnBytes) * as->columnBytes : as->expected;
+  complete = complete && (target == as->written);
+
+  static const char zeros[4096] = {0};
+  bool ok = true;
+  while(ok && as->written < target) {
+    std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(sizeof(zeros), target - as->written));
+    ok = as->sink->write(zeros, n);
+    as->written += n;
+  }
+  ok = ok && as->sink->pad(as->written);
+
+  if(as->isDeferred())
+    ok = ok && as->sink->finish() && patchDeferred(mfp->fp, *as);
+  else if(mfp->compressed)
+    ok = ok && endCompressed(mfp->fp, as->start, *as->sink);
+  else
+    ok = ok && as->sink->finish();
+
+  if(ok)
+    mfp->names.push_back(as->name);
+  return (ok && complete) ? 0 : 1;
+}
+
+
+char** matGetDir(MATFile* mfp, int* num) {
+  /* One block, holding the pointers followed by the strings, so that a
+     single mxFree() releases everything */
+  *num = 0;
+  if(!mfp || mfp->names.empty())
+    return nullptr;
+
+  std::size_t bytes = mfp->names.size() * sizeof(char*);
+  for(const auto& n : mfp->names)
+    bytes += n.size() + 1;
+
+  char** dir = static_cast<char**>(std::malloc(bytes));
+  if(!dir)
+    return nullptr;
+
+  char* str = reinterpret_cast<char*>(dir + mfp->names.size());
+  for(std::size_t i = 0; i < mfp->names.size(); i++) {
+    std::memcpy(str, mfp->names[i].c_str(), mfp->names[i].size() + 1);
+    dir[i] = str;
+    str += mfp->names[i].size() + 1;
+  }
+
+  *num = static_cast<int>(mfp->names.size());
+  return dir;
+}
+
+
+mxArray* matGetVariable(MATFile*, const char*) {
+  return nullptr;
+}
+
+
+mxArray* matGetVariableInfo(MATFile*, const char*) {
+  return nullptr;
+}
+
+
+int matDeleteVariable(MATFile*, const char*) {
+  return 1;
+}
+
+}
@@ -0,0 +1,103 @@
+#pragma once
+#ifndef MATV5_H_INCLUDED
+#define MATV5_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+
+/* A self-contained MAT (Level 5) writer that stands in for the MathWorks'
+   mat.h/matrix.h. It provides the subset of their C API that MATFile and the
+   programs use (numeric, logical, char and struct arrays), so everything can
+   be built with a plain C++ compiler and zlib, and run on machines without
+   MATLAB or a license server. Build with -DNATIVE_MAT_FILE to use it.
+
+   Files are write-only: open them with "w" or "wz". With "wz", every variable
+   is deflated on its way to disk, so a variable is never held in memory
+   twice. The v5 format limits each variable to 4 GB (compressed, with "wz").
+
+   Unlike the MathWorks' library, the structs below aren't opaque, but treat
+   them as if they were and stick to the functions.
+*/
+
+namespace MW {
+
+typedef std::size_t   mwSize;
+typedef std::size_t   mwIndex;
+typedef std::uint16_t mxChar;
+typedef bool          mxLogical;
+
+/* Numbered as in matrix.h */
+typedef enum {
+  mxUNKNOWN_CLASS = 0,
+  mxCELL_CLASS,
+  mxSTRUCT_CLASS,
+  mxLOGICAL_CLASS,
+  mxCHAR_CLASS,
+  mxVOID_CLASS,
+  mxDOUBLE_CLASS,
+  mxSINGLE_CLASS,
+  mxINT8_CLASS,
+  mxUINT8_CLASS,
+  mxINT16_CLASS,
+  mxUINT16_CLASS,
+  mxINT32_CLASS,
+  mxUINT32_CLASS,
+  mxINT64_CLASS,
+  mxUINT64_CLASS,
+  mxFUNCTION_CLASS
+} mxClassID;
+
+typedef enum {
+  mxREAL,
+  mxCOMPLEX
+} mxComplexity;
+
+struct mxArray;
+struct MATFile;
+
+mxArray* mxCreateNumericArray(mwSize ndim, const mwSize* dims, mxClassID classid, mxComplexity flag);
+mxArray* mxCreateDoubleMatrix(mwSize m, mwSize n, mxComplexity flag);
+mxArray* mxCreateDoubleScalar(double value);
+mxArray* mxCreateLogicalArray(mwSize ndim, const mwSize* dims);
+mxArray* mxCreateLogicalScalar(bool value);
+mxArray* mxCreateString(const char* str);
+mxArray* mxCreateStructArray(mwSize ndim, const mwSize* dims, int nfields, const char** fieldnames);
+
+void*   mxGetData(const mxArray* pa);
+double* mxGetPr(const mxArray* pa);
+
+/* Like the originals, these don't free whatever was in the field before */
+void mxSetFieldByNumber(mxArray* pa, mwIndex i, int fieldnum, mxArray* value);
+void mxSetField(mxArray* pa, mwIndex i, const char* fieldname, mxArray* value);
+
+void mxDestroyArray(mxArray* pa);
+void mxFree(void* ptr);
+
+MATFile* matOpen(const char* filename, const char* mode);
+int      matClose(MATFile* mfp);
+FILE*    matGetFp(MATFile* mfp);
+int      matPutVariable(MATFile* mfp, const char* name, const mxArray* pa);
+int      matPutVariableAsGlobal(MATFile* mfp, const char* name, const mxArray* pa);
+
+/* Not in the MathWorks API: write one variable a piece at a time, without
+   holding all of it in memory. dims[deferred] is ignored and worked out on
+   close from the amount of data written; pass deferred = ndim if every
+   dimension is known. Dimensions after the deferred one must be 1. Only one
+   stream can be open per file, and nothing else can be written meanwhile.
+   Variables with a deferred dimension are never compressed. */
+int matOpenArrayStream(MATFile* mfp, const char* name, mxClassID classid,
+		       mwSize ndim, const mwSize* dims, mwSize deferred, bool global);
+int matWriteArrayStream(MATFile* mfp, const void* data, std::size_t bytes);
+int matCloseArrayStream(MATFile* mfp);
+
+/* Reading isn't supported: these return NULL (or 1, for matDeleteVariable).
+   matGetDir lists the variables written so far. */
+char**   matGetDir(MATFile* mfp, int* num);
+mxArray* matGetVariable(MATFile* mfp, const char* name);
+mxArray* matGetVariableInfo(MATFile* mfp, const char* name);
+int      matDeleteVariable(MATFile* mfp, const char* name);
+
+}
+
+#endif
@@ -5,29 +5,46 @@
 #include <iostream>
 #include <map>
 #include <iomanip>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+#include <tuple>
+#include <vector>
 
 #include "nev2plx_config.h"
 #include "NEVFile.h"
+#include "plxwriter.h"
 
 typedef std::map<std::uint16_t, int> IndexMap;
 const int EV_COUNT = 21;
 const int SLOW_CHANNELS = 0;
-
-void write_file_header(NEVFile &src, std::fstream &dst);
-void write_spike_headers(NEVFile &src, std::fstream &dst);
-void write_event_headers(std::fstream &dst);
-
-std::int16_t write_digital(std::shared_ptr<DigitalPacket> packet,
-		   std::fstream &plx,
+const std::int32_t SNIP_LENGTH = 52;          // From Ripple docs
+
+/* Where write_file_header and write_spike_headers left placeholders,
+   so the real values can be patched in once all the packets are written */
+struct HeaderOffsets {
+  std::uint64_t last_timestamp;
+  std::uint64_t ts_counts;
+  std::uint64_t wf_counts;
+  std::uint64_t ev_counts;
+  std::vector<std::uint64_t> n_units;   // One per spike channel
+};
+
+void write_file_header(NEVFile &src, PlxWriter &dst, HeaderOffsets &offsets);
+void write_spike_headers(NEVFile &src, PlxWriter &dst, HeaderOffsets &offsets);
+void write_event_headers(PlxWriter &dst);
+
+std::int16_t write_digital(const DigitalPacket &packet,
+		   PlxWriter &plx,
 		   std::uint16_t inital_value=0,
 		   bool ignore_zeros=true,
 		   bool ignore_negatives=true);
 
-std::tuple<std::int16_t, std::int16_t> write_spike(std::shared_ptr<SpikePacket> packet,
-		 std::fstream &plx,
-		 IndexMap &channel_map);
-std::int16_t write_microstim(std::shared_ptr<StimPacket> packet,
-				      std::fstream &plx);
+std::tuple<std::int16_t, std::int16_t> write_spike(const SpikeView &packet,
+		 PlxWriter &plx,
+		 const IndexMap &channel_map);
+std::int16_t write_microstim(const StimView &packet,
+				      PlxWriter &plx);
 
 std::map<std::uint16_t, int> channel_to_index(NEVFile &nev);
 
@@ -46,10 +63,11 @@ int main(int argc, char* argv[]) {
   NEVFile nev(config.get_input(), config.get_buffer_sz());
   
   auto map = channel_to_index(nev);   
-  auto plx = std::fstream(config.get_output(), std::ios::out | std::ios::binary);
+  PlxWriter plx(config.get_output());
+  HeaderOffsets offsets;
   
-  write_file_header(nev, plx);
-  write_spike_headers(nev, plx);
+  write_file_header(nev, plx, offsets);
+  write_spike_headers(nev, plx, offsets);
   write_event_headers(plx);
 
   auto  count = 0;
@@ -60,19 +78,54 @@ int main(int argc, char* argv[]) {
   int ev_counts[512] = {0};
   int sp_counts[130][5] ={0};
   
-  while(!nev.eof()) {
-    std::shared_ptr<Packet> packet = nev.readPacket(true, true, true);
-    last_timestamp = packet->timestamp;
-
-    if(auto p = std::dynamic_pointer_cast<DigitalPacket>(packet)) {
+  /* One overload per packet type; NEVFile picks the right one with a
+     switch on the packet ID, so there's no casting (or allocating) here */
+  struct Writer {
+    PlxWriter &plx;
+    IndexMap &map;
+    std::uint32_t &last_timestamp;
+    std::int16_t &chan;
+    std::int16_t &unit;
+    int (&ev_counts)[512];
+    int (&sp_counts)[130][5];
+
+    void operator()(const DigitalPacket &p) {
+      last_timestamp = p.timestamp;
       chan = write_digital(p, plx, 3840, true, true);
-      ev_counts[chan]++;
-    } else if (auto p = std::dynamic_pointer_cast<SpikePacket>(packet)) {
+      if(chan >= 0 && chan < 512)
+	ev_counts[chan]++;
+    }
+    void operator()(const SpikeView &p) {
+      last_timestamp = p.timestamp;
       std::tie(chan, unit) = write_spike(p, plx, map);
-      sp_counts[chan][unit]++;      
-    } else if (auto p = std::dynamic_pointer_cast<StimPacket>(packet)) {
+      if(chan >= 0 && chan < 130 && unit >= 0 && unit < 5)
+	sp_counts[chan][unit]++;
+    }
+    void operator()(const StimView &p) {
+      last_timestamp = p.timestamp;
       chan = write_microstim(p, plx);
+      ev_counts[chan]++;
     }
+  } writer{plx, map, last_timestamp, chan, unit, ev_counts, sp_counts};
+
+  while(nev.visitPackets(writer, config.get_buffer_sz()) > 0)
+    ;
+
+  /* Second pass: go back and fill in the header's counts. Spikes always
+     carry a waveform, so the timestamp and waveform counts are the same */
+  double last = double(last_timestamp);
+  plx.patch(offsets.last_timestamp, (char*) &last, sizeof(last));
+  plx.patch(offsets.ts_counts, (char*) sp_counts, sizeof(sp_counts));
+  plx.patch(offsets.wf_counts, (char*) sp_counts, sizeof(sp_counts));
+  plx.patch(offsets.ev_counts, (char*) ev_counts, sizeof(ev_counts));
+
+  for(std::size_t i = 0; i < offsets.n_units.size(); i++) {
+    std::size_t ch = i + 1;   // channel_to_index numbers channels from 1
+    std::int32_t n_units = 0;
+    if(ch < 130)
+      for(int u = 1; u < 5; u++)
+	n_units += sp_counts[ch][u] > 0;
+    plx.patch(offsets.n_units[i], (char*) &n_units, sizeof(n_units));
   }
    
   plx.close();  
@@ -82,10 +135,9 @@ int main(int argc, char* argv[]) {
 
 
 
-void write_file_header(NEVFile &src, std::fstream &dst) {
+void write_file_header(NEVFile &src, PlxWriter &dst, HeaderOffsets &offsets) {
   const std::uint32_t MAGIC = 0x58454c50;
   const std::int32_t VERSION = 105;             // Wild guess
-  const std::int32_t SNIP_LENGTH = 52;          // From Ripple docs
   const std::int32_t PRETHRESH_SNIP_LENGTH = 15;// From Ripple docs
   const std::int32_t FAST_READ = 0;             // No idea!
   const std::uint16_t PREAMP_GAIN = 1;          // Not really relevant here...
@@ -125,9 +177,10 @@ void write_file_header(NEVFile &src, std::fstream &dst) {
 
   dst.write((char*) &FAST_READ, sizeof(FAST_READ));
   auto fs = int(src.get_waveformFS());
-  dst.write((char*) &ts, sizeof(fs));
+  dst.write((char*) &fs, sizeof(fs));
 
   double dummy_last = 0.0;
+  offsets.last_timestamp = dst.tell();
   dst.write((char*) &dummy_last, sizeof(double));
   dst.write((char*) &TRODALNESS, sizeof(TRODALNESS)); 
   dst.write((char*) &TRODALNESS, sizeof(TRODALNESS)); //Yes, repeated twice 
@@ -154,8 +207,11 @@ void write_file_header(NEVFile &src, std::fstream &dst) {
   dst.write((char*) &PREAMP_GAIN, sizeof(PREAMP_GAIN));
   dst.write((char*) padding, sizeof(char)*46); //Per docs
 
+  offsets.ts_counts = dst.tell();
   dst.write((char*) dummy_ts, sizeof(std::int32_t)*130*5);
+  offsets.wf_counts = dst.tell();
   dst.write((char*) dummy_ts, sizeof(std::int32_t)*130*5);
+  offsets.ev_counts = dst.tell();
   dst.write((char*) dummy_ev, sizeof(std::int32_t)*512);
 	   
   return;
@@ -170,7 +226,7 @@ std::map<std::uint16_t, int> channel_to_index(NEVFile &nev) {
   return m;
 }
 
-void write_spike_headers(NEVFile &src, std::fstream &dst) {
+void write_spike_headers(NEVFile &src, PlxWriter &dst, HeaderOffsets &offsets) {
   const std::int32_t WF_RATE = 10;
   const std::int32_t REF_CHANNEL = 0;
   const std::int32_t GAIN = 32;
@@ -209,6 +265,7 @@ void write_spike_headers(NEVFile &src, std::fstream &dst) {
     dst.write((char*) &FILTER, sizeof(FILTER));
     dst.write((char*) &THRESHOLD, sizeof(THRESHOLD));
     dst.write((char*) &METHOD, sizeof(METHOD));
+    offsets.n_units.push_back(dst.tell());
     dst.write((char*) &n_units_dummy, sizeof(n_units_dummy));
     dst.write((char*) TEMPLATE, sizeof(std::int16_t)*5*64);
     dst.write((char*) &FIT, sizeof(FIT[0])*5);
@@ -222,7 +279,7 @@ void write_spike_headers(NEVFile &src, std::fstream &dst) {
   }    
 } 
     
- write_event_headers(std::fstream &dst) {
+void write_event_headers(PlxWriter &dst) {
   const int PADDING[33] = {0};
 
   // Create one event channel for the parallel port
@@ -245,7 +302,7 @@ void write_spike_headers(NEVFile &src, std::fstream &dst) {
   }
 
   // Create one event channel per SMA channel
-  for(int i=17; i<20; i++) {
+  for(int i=17; i<=20; i++) {
      std::ostringstream name_ss;
      name_ss << "Event" << std::setw(3) << std::setfill('0') << i;
      std::string name =  name_ss.str();
@@ -279,9 +336,9 @@ void write_spike_headers(NEVFile &src, std::fstream &dst) {
   }
 }
 
-std::int16_t write_digital(std::shared_ptr<DigitalPacket> packet,
-		    std::fstream &plx,
-		    std::uint16_t inital_value=0,
+std::int16_t write_digital(const DigitalPacket &packet,
+		    PlxWriter &plx,
+		    std::uint16_t inital_value,
 		    bool ignore_zeros,
 		    bool ignore_negatives) {
 
@@ -299,27 +356,24 @@ std::int16_t write_digital(std::shared_ptr<DigitalPacket> packet,
    static std::uint16_t last_value;
    const int N_PARALLEL_EVENTS = 16;
    
-   const std::int16_t BLOCK_TYPE = 4;
-   const std::uint16_t hi_time = 0;
-   const std::int16_t UNIT_ID = 0;
-   const std::int16_t N_WAVEFORMS = 0;
-   const std::int16_t N_WORDS = 0;
    int new_value;
-   std::int16_t channel;
+   std::int16_t channel = -1;
    
-   switch(packet->reason) {
+   switch(packet.reason) {
      case DigitalReason::PARALLEL:
        if(!initalized) {
 	 last_value = inital_value;
 	 initalized = true;
        }
 
-       new_value = packet->parallel - last_value;
-       channel = std::int16_t(log2(abs(new_value)));
-       last_value = packet->parallel;
+       new_value = packet.parallel - last_value;
+       last_value = packet.parallel;
        if((ignore_negatives && new_value<0) || (ignore_zeros && new_value==0)) {
-	 return;
+	 return -1;
        }
+       if(new_value == 0)
+	 return -1;   // No bit changed, so there's no channel to put it on
+       channel = std::int16_t(std::log2(std::abs(new_value)));
      break;
    case DigitalReason::SMA1:
      channel = N_PARALLEL_EVENTS + 1;
@@ -333,59 +387,32 @@ std::int16_t write_digital(std::shared_ptr<DigitalPacket> packet,
    case DigitalReason::SMA4:
      channel = N_PARALLEL_EVENTS + 4;
      break;
+   default:
+     return -1;
    }
    
-   plx.write((char*) &BLOCK_TYPE, sizeof(BLOCK_TYPE));
-   plx.write((char*) &hi_time, sizeof(hi_time));
-   plx.write((char*) &(packet->timestamp), sizeof(std::uint32_t));
-   plx.write((char*) &channel, sizeof(std::int16_t));
-   plx.write((char*) &UNIT_ID, sizeof(UNIT_ID));
-   plx.write((char*) &N_WAVEFORMS, sizeof(N_WAVEFORMS));
-   plx.write((char*) &N_WORDS, sizeof(N_WORDS));
+   plx.event(packet.timestamp, channel);
    return channel;
  }
 
 
-auto write_spike(std::shared_ptr<SpikePacket> packet,
-			  std::fstream &plx, const IndexMap &channel_map,
-			  std::uint32_t &timestamp){
-  
-  static std::int16_t BLOCK_TYPE = 1;
-  static std::uint16_t hi_time = 0;
-  static std::int16_t N_WAVEFORMS = 1;
-  static std::int16_t N_WORDS=52;
-  short channel = short(channel_map[packet->electrodeID]);
-  
-  plx.write((char*) &BLOCK_TYPE, sizeof(BLOCK_TYPE));
-  plx.write((char*) &hi_time,    sizeof(hi_time));
-  plx.write((char*) &(packet->timestamp), sizeof(std::uint32_t));
-  plx.write((char*) &channel, sizeof(std::uint16_t));
-  plx.write((char*) &(packet->unit), sizeof(std::uint16_t));
-  plx.write((char*) &N_WAVEFORMS, sizeof(N_WAVEFORMS));
-  plx.write((char*) &(N_WORDS), sizeof(N_WORDS));
-  plx.write((char*) packet->waveform, sizeof(char) * packet->len);
-
-  return std::make_tuple(channel, packet->unit);
+std::tuple<std::int16_t, std::int16_t> write_spike(const SpikeView &packet,
+		 PlxWriter &plx,
+		 const IndexMap &channel_map) {
+
+  auto i = channel_map.find(packet.electrodeID);
+  std::int16_t channel = std::int16_t(i == channel_map.end() ? 0 : i->second);
+  std::int16_t unit = std::int16_t(packet.unit);
+
+  plx.spike(packet.timestamp, channel, unit, packet.waveform, packet.len, SNIP_LENGTH);
+  return std::make_tuple(channel, unit);
 }  
 
 
- std::int16_t write_microstim(std::shared_ptr<StimPacket> packet,
-			      std::fstream &plx) {
+ std::int16_t write_microstim(const StimView &packet,
+			      PlxWriter &plx) {
    
-   std::int16_t BLOCK_TYPE = 4; //Event, not segment!
-   std::uint16_t hi_time = 0;
    std::int16_t stim_event_channel = 21;
-   std::int16_t unit = 0;
-   std::int16_t N_WAVEFORMS = 0;
-   std::int16_t N_WORDS = 0;
-  
-   plx.write((char*) &BLOCK_TYPE, sizeof(BLOCK_TYPE));
-   plx.write((char*) &hi_time, sizeof(hi_time));
-   plx.write((char*) &(packet->timestamp), sizeof(std::uint32_t));
-   plx.write((char*) &stim_event_channel, sizeof(std::int16_t));
-   plx.write((char*) &unit, sizeof(unit));
-   plx.write((char*) &N_WAVEFORMS, sizeof(N_WAVEFORMS));
-   plx.write((char*) &N_WORDS, sizeof(N_WORDS));
-   
+   plx.event(packet.timestamp, stim_event_channel);
    return stim_event_channel;
  }
@@ -0,0 +1,27 @@
+#pragma once
+#ifndef NEVWRITER_H_INCLUDED
+#define NEVWRITER_H_INCLUDED
+
+#include "eventsoa.h"
+#include "packetsoa.h"
+
+/* NEVExtract writes its output files while it reads, instead of loading
+   the whole NEV file first. Making a writer starts its file; append() then
+   gets each batch of packets, in file order, and finish() completes the
+   file. The batches are reused, so copy anything that has to outlive the
+   call. Formats that need totals before they can write anything (e.g.,
+   MAT) spool the batches to a temporary file until finish().
+*/
+template <typename SOA>
+class BatchWriter {
+public:
+  virtual ~BatchWriter() { }
+  virtual void append(const SOA &batch) = 0;
+  virtual void finish() = 0;
+};
+
+typedef BatchWriter<EventSOA> EventWriter;
+typedef BatchWriter<StimSOA>  StimWriter;
+typedef BatchWriter<SpikeSOA> SpikeWriter;
+
+#endif
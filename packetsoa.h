@@ -0,0 +1,66 @@
+#pragma once
+#ifndef PACKETSOA_H_INCLUDED
+#define PACKETSOA_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "eventsoa.h"
+
+/* Column-oriented storage for every kind of NEV packet, filled in bulk by
+   NEVFile::readColumns(). Like EventSOA (which holds the digital events),
+   each field is its own array, so writers can walk one field at a time.
+
+   Waveforms are stored back to back in one byte array; row i's waveform
+   is waveforms[offset[i]] ... waveforms[offset[i] + len[i] - 1]. Continuation
+   packets are already appended, so every waveform is complete.
+*/
+
+struct WaveSOA {
+  std::vector<std::uint32_t> ts;
+  std::vector<std::uint16_t> electrode;
+  std::vector<std::size_t>   offset;
+  std::vector<std::uint32_t> len;
+  std::vector<char>          waveforms;
+
+  std::size_t size() const { return ts.size(); }
+  const char* waveform(std::size_t i) const { return waveforms.data() + offset[i]; }
+
+  void clear() {
+    ts.clear();
+    electrode.clear();
+    offset.clear();
+    len.clear();
+    waveforms.clear();
+  }
+};
+
+
+struct SpikeSOA : WaveSOA {
+  std::vector<std::uint8_t> unit;
+
+  void clear() {
+    WaveSOA::clear();
+    unit.clear();
+  }
+};
+
+
+struct StimSOA : WaveSOA {
+};
+
+
+struct PacketSOA {
+  EventSOA events;
+  SpikeSOA spikes;
+  StimSOA  stims;
+
+  void clear() {
+    events.clear();
+    spikes.clear();
+    stims.clear();
+  }
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "plxwriter.h"
+
+namespace {
+  /* Every data block starts with one of these; there's no padding in it */
+  struct DataBlockHeader {
+    std::int16_t type;
+    std::uint16_t upperTimestamp;
+    std::uint32_t timestamp;
+    std::int16_t channel;
+    std::int16_t unit;
+    std::int16_t nWaveforms;
+    std::int16_t nWords;
+  };
+  static_assert(sizeof(DataBlockHeader) == 16, "PLX data block header must be 16 bytes");
+
+  const std::int16_t SPIKE_BLOCK = 1;
+  const std::int16_t EVENT_BLOCK = 4;
+}
+
+
+PlxWriter::PlxWriter(const std::string &filename, std::size_t bufferSize) :
+  out(filename, std::ios::out | std::ios::binary | std::ios::trunc),
+  buffer(std::max<std::size_t>(bufferSize, 4096)),
+  used(0),
+  flushed(0) {
+
+  if(!out)
+    throw(std::runtime_error("Cannot open " + filename + " for writing"));
+}
+
+
+PlxWriter::~PlxWriter() {
+  try {
+    close();
+  } catch(...) {
+    // Nowhere to report it from here; call close() to find out
+  }
+}
+
+
+char* PlxWriter::reserve(std::size_t len) {
+  if(used + len > buffer.size()) {
+    flush();
+    if(len > buffer.size())
+      buffer.resize(len);
+  }
+
+  char* dst = buffer.data() + used;
+  used += len;
+  return dst;
+}
+
+
+void PlxWriter::write(const char* data, std::size_t len) {
+  if(len == 0)
+    return;
+  std::memcpy(reserve(len), data, len);
+}
+
+
+void PlxWriter::event(std::uint32_t timestamp, std::int16_t channel, std::int16_t unit) {
+  DataBlockHeader h = {EVENT_BLOCK, 0, timestamp, channel, unit, 0, 0};
+  std::memcpy(reserve(sizeof(h)), &h, sizeof(h));
+}
+
+
+void PlxWriter::spike(std::uint32_t timestamp, std::int16_t channel, std::int16_t unit,
+                      const char* waveform, std::size_t len, std::int16_t nWords) {
+  const std::size_t waveBytes = sizeof(std::int16_t) * std::size_t(nWords);
+  DataBlockHeader h = {SPIKE_BLOCK, 0, timestamp, channel, unit, 1, nWords};
+
+  char* dst = reserve(sizeof(h) + waveBytes);
+  std::memcpy(dst, &h, sizeof(h));
+  dst += sizeof(h);
+
+  const std::size_t n = std::min(len, waveBytes);
+  std::memcpy(dst, waveform, n);
+  std::memset(dst + n, 0, waveBytes - n);
+}
+
+
+void PlxWriter::patch(std::uint64_t offset, const char* data, std::size_t len) {
+  if(offset + len > tell())
+    throw(std::out_of_range("Patching past the end of the .plx file"));
+
+  flush();
+  out.seekp(std::streamoff(offset));
+  out.write(data, std::streamsize(len));
+  out.seekp(0, std::ios::end);
+
+  if(!out)
+    throw(std::runtime_error("Unable to patch .plx header"));
+}
+
+
+void PlxWriter::flush() {
+  if(used == 0 || !out.is_open())
+    return;
+
+  out.write(buffer.data(), std::streamsize(used));
+  if(!out)
+    throw(std::runtime_error("Unable to write to .plx file"));
+
+  flushed += used;
+  used = 0;
+}
+
+
+void PlxWriter::close() {
+  if(!out.is_open())
+    return;
+
+  flush();
+  out.close();
+  if(!out)
+    throw(std::runtime_error("Unable to close .plx file"));
+}
@@ -0,0 +1,55 @@
+#pragma once
+#ifndef PLXWRITER_H_INCLUDED
+#define PLXWRITER_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/* PlxWriter: buffered output for .plx files.
+
+   Records are serialized straight into a large buffer, which goes to disk
+   in one write whenever it fills up, so a spike costs two memcpys instead
+   of eight stream calls. write() takes raw bytes (for the headers), while
+   event() and spike() lay out a whole data block at once.
+
+   The header's counts aren't known until every packet has been seen, so
+   write placeholders, remember where they went with tell(), and fill them
+   in with patch() at the end.
+*/
+class PlxWriter {
+public:
+  PlxWriter(const std::string &filename, std::size_t bufferSize = 8 << 20);
+  ~PlxWriter();
+
+  PlxWriter(const PlxWriter &rhs) = delete;
+  PlxWriter& operator=(const PlxWriter &rhs) = delete;
+
+  void write(const char* data, std::size_t len);
+  template <typename T> void put(const T &value) {
+    write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  /* Data blocks. Waveforms are truncated or zero-padded to nWords samples */
+  void event(std::uint32_t timestamp, std::int16_t channel, std::int16_t unit = 0);
+  void spike(std::uint32_t timestamp, std::int16_t channel, std::int16_t unit,
+             const char* waveform, std::size_t len, std::int16_t nWords);
+
+  std::uint64_t tell() const { return flushed + used; }
+  void patch(std::uint64_t offset, const char* data, std::size_t len);
+
+  void flush();
+  void close();
+
+private:
+  char* reserve(std::size_t len);
+
+  std::ofstream out;
+  std::vector<char> buffer;
+  std::size_t used;        // Bytes waiting in the buffer
+  std::uint64_t flushed;   // Bytes already handed to the stream
+};
+
+#endif
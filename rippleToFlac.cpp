@@ -4,43 +4,23 @@
 #include <FLAC++/metadata.h>
 #include <FLAC++/encoder.h>
 #include <memory>
+#include <algorithm>
+#include <exception>
+#include <vector>
 
 
 #include "NSxConfig.h"
 #include "NSxFile.h"
 
-#ifdef WINDOWS
-#include "mingw.thread.h"
-#endif
-
-#include <thread>
-
-typedef std::vector<std::unique_ptr<FLAC::Encoder::File> > EncoderBank;
-
-struct ThreadData {
-  /* This structure is for farming out FLAC encoding to separate threads. 
-     It neither creates nor destroys any of these things! It's just a passthrough*/
-  ThreadData(std::int16_t* _bulkBuffer, EncoderBank *_e, unsigned _nChannels) {
-    bulkBuffer = _bulkBuffer;
-    e = _e;
-    nChannels = _nChannels;
-  }
-
-  std::int16_t* bulkBuffer;
-  FLAC__int32* channelBuffer;
-  EncoderBank* e;
-  unsigned nChannels;
-
-  unsigned datalen;
-
-  unsigned start;
-  unsigned stop;
-};
+#include "EncoderPool.h"
+#include "deinterleave.h"
 
+void runWorkQueue(const WorkQueue &work, unsigned nThreads, unsigned nJobs);
 void runConfiguration(const NSxConfig & c);
-void encode_singleThreaded(NSxFile &f, const NSxConfig &c, EncoderBank &e);
-void encode_multiThreaded(NSxFile &f, const NSxConfig &config, EncoderBank &encoders);
-void doEncode(ThreadData d);
+void encode_singleThreaded(NSxFile &f, const NSxConfig &c, EncoderBank &e,
+			   const std::vector<std::uint32_t> &columns);
+void encode_multiThreaded(NSxFile &f, const NSxConfig &config, EncoderBank &encoders,
+			  const std::vector<std::uint32_t> &columns);
 
 
 int main(int argc, char *argv[]) {
@@ -55,39 +35,106 @@ int main(int argc, char *argv[]) {
     }
 
     std::cout << config;
+    std::cout << "\t De-interleaving with the " << deinterleaveKernelName() << " kernel" << std::endl;
       
           
     WorkQueue work = config.toWorkQueue();
-    for (NSxConfig c: work) {
+    runWorkQueue(work, config.nThreads(), config.parallelFiles());
+}
+
+
+void runWorkQueue(const WorkQueue &work, unsigned nThreads, unsigned nJobs) {
+
+  /* Converting one file is mostly CPU-bound, but a single file can't always
+     use a big machine on its own (there are only so many channels, and the
+     reader is serial). So, in directory mode, several files are converted
+     at once and the --threads budget is split between them. Each job slot
+     pulls the next file off the queue, which is sorted largest first. */
+
+  if(nJobs == 0)
+    nJobs = nThreads;
+  nJobs = std::max(1U, std::min<unsigned>(nJobs, unsigned(work.size())));
+  
+  std::size_t next = 0;
+  std::exception_ptr error;
+  std::mutex lock; // Guards next, error, and std::cout
+
+  auto slot = [&](unsigned threads) {
+    while(true) {
+      std::size_t i;
+      {
+	std::lock_guard<std::mutex> guard(lock);
+	if(next == work.size() || error)
+	  return;
+	i = next++;
+      }
+
       try {
-	std::cout << c;
+	NSxConfig c = work[i].withThreads(threads);
+	{
+	  std::lock_guard<std::mutex> guard(lock);
+	  std::cout << c;
+	}
 	runConfiguration(c);
-      } catch (std::runtime_error e) {
+      } catch (std::exception &e) {
+	std::lock_guard<std::mutex> guard(lock);
 	std::cerr << "Error processing configuration: " << e.what() << std::endl;
-	throw(e);
-	  
+	if(!error)
+	  error = std::current_exception();
       }
     }
-      
+  };
+
+  /* Spread the threads evenly. Any leftovers go to the first few slots,
+     not to particular files: slots take files as they come free. */
+  std::vector<std::thread> jobs;
+  for(auto i = 1U; i < nJobs; i++)
+    jobs.push_back(std::thread(slot, std::max(1U, nThreads / nJobs + (i < nThreads % nJobs))));
+  slot(std::max(1U, nThreads / nJobs + (0 < nThreads % nJobs)));
+
+  for(auto &j: jobs)
+    j.join();
+  
+  if(error)
+    std::rethrow_exception(error);
+}
+
+namespace {
+  /* runWorkQueue() may convert several files at once, but the MathWorks'
+     MAT-file library isn't thread-safe, so headers are written one at a time */
+  std::mutex headerLock;
 }
 
 void runConfiguration(const NSxConfig &config) {
-  NSxFile f(config.input());
-  
-  if(config.matlabHeader()) {
-    f.writeMatHeader(config);
-  }
+  NSxFile f(config.input(), config.useMmap(), config.useIndexFile());
+
+  {
+    std::lock_guard<std::mutex> guard(headerLock);
+    if(config.matlabHeader()) {
+      f.writeMatHeader(config);
+    }
   
-  if(config.textHeader()) {
-    f.writeTxtHeader(config);
+    if(config.textHeader()) {
+      f.writeTxtHeader(config);
+    }
   }
   
   if(config.compressData()) {
+    /* Encoders are only made for the selected channels; the others are
+       never de-interleaved. */
+    std::vector<std::uint32_t> columns;
+    if(config.channels().empty()) {
+      for(auto i = 0U; i < f.getChannelCount(); i++)
+	columns.push_back(i);
+    } else {
+      columns = f.selectChannels(config.channels());
+    }
+
     EncoderBank encoders;
-    encoders.reserve(f.getChannelCount());
+    encoders.reserve(columns.size());
     
-    unsigned i = 0;
-    for(auto ch=f.channelBegin(); ch!=f.channelEnd(); i++, ch++) {
+    for(auto i = 0U; i < columns.size(); i++) {
+      const NSxChannel &ch = *(f.channelBegin() + columns[i]);
       encoders.push_back(std::unique_ptr<FLAC::Encoder::File>(new FLAC::Encoder::File));
       
       bool ok = true;
@@ -100,35 +147,42 @@ void runConfiguration(const NSxConfig &config) {
 	throw(std::runtime_error("Unable to configure FLAC encoder"));
       }
       
-      std::string filename = config.outputFilename((*ch).getNumericID());
+      std::string filename = config.outputFilename(ch.getNumericID());
       encoders[i]->init(filename.c_str());
     }
     
-    if(config.nThreads() == 1)
-      encode_singleThreaded(f, config, encoders);
+    if(config.nThreads() == 1 && config.prefetchBlocks() == 0)
+      encode_singleThreaded(f, config, encoders, columns);
     else
-      encode_multiThreaded(f, config, encoders);
+      encode_multiThreaded(f, config, encoders, columns);
   }
 }
 
 
-void encode_singleThreaded(NSxFile &f, const NSxConfig &config, EncoderBank &encoders) {
+void encode_singleThreaded(NSxFile &f, const NSxConfig &config, EncoderBank &encoders,
+			   const std::vector<std::uint32_t> &columns) {
     
-  std::int16_t* bulkBuffer = nullptr; // Allocated by f.readData; deleted below
+  auto nChannels = f.getChannelCount();
+  auto nSelected = columns.size();
+  std::int16_t* bulkBuffer = new std::int16_t[config.readSize() * nChannels];
+  const char* samples = reinterpret_cast<const char*>(bulkBuffer); // or a view into the mapped file
 
-  FLAC__int32* channelBuffer = new FLAC__int32[config.readSize()];
-  const FLAC__int32* c = channelBuffer;
+  // One plane of readSize samples per selected channel
+  FLAC__int32* channelBuffer = new FLAC__int32[std::size_t(config.readSize()) * nSelected];
 
-  // Read in a chunk of data, extract each electrode's "column", and encode it
-  auto nChannels = f.getChannelCount();
+  // Read in a chunk of data, split it into each electrode's "column", and encode them
   while(f.hasMoreData()) {      
-    auto datalen = f.readData(config.readSize(), bulkBuffer);
+    size_t datalen;
+    if(f.isMapped())
+      datalen = f.readView(config.readSize(), samples);
+    else
+      datalen = f.readData(config.readSize(), bulkBuffer);
 
-    for(auto chan = 0U; chan < nChannels; chan++) {
-      for(auto i=chan, j=0U; i<datalen*nChannels; i+=nChannels, j++) {
-	channelBuffer[j] = FLAC__int32(bulkBuffer[i]);
-      }
-      
+    deinterleaveColumns(samples, datalen, nChannels, columns.data(), nSelected,
+			channelBuffer, config.readSize());
+
+    for(auto chan = 0U; chan < nSelected; chan++) {
+      const FLAC__int32* c = channelBuffer + std::size_t(chan) * config.readSize();
       encoders[chan]->process(&c, datalen);
     }
   }
@@ -142,64 +196,50 @@ void encode_singleThreaded(NSxFile &f, const NSxConfig &config, EncoderBank &enc
   delete[] channelBuffer;
 }
 
-void encode_multiThreaded(NSxFile &f, const NSxConfig &config, EncoderBank &encoders) {
+void encode_multiThreaded(NSxFile &f, const NSxConfig &config, EncoderBank &encoders,
+			  const std::vector<std::uint32_t> &columns) {
 
   /* After watching a few runs, it looks like this program is almost always 
-     CPU-bound (surprisingly little I/O waiting). So...let's get some more CPUs! */
-
-  std::int16_t* bulkBuffer = nullptr; //Will be alloced by NSxFile.readData()
-  FLAC__int32** channelBuffers = new FLAC__int32*[config.nThreads()];
-
-  // Pack stuff into a struct for easier transfer and allocate buffers for each thread
-  ThreadData td(bulkBuffer, &encoders, f.getChannelCount());
-  unsigned stride = unsigned(std::ceil(double(f.getChannelCount()) / double(config.nThreads())));
-
-  for(auto i=0U; i<config.nThreads(); i++) {
-    channelBuffers[i] = new FLAC__int32[config.readSize()];
-  }
-  
-  while(f.hasMoreData()) {
-    td.datalen = f.readData(config.readSize(), td.bulkBuffer);
-
-    std::vector<std::unique_ptr<std::thread> > threads;
-    for(auto i = 0U; i<config.nThreads(); i++) {
-      td.start = stride * i;
-      td.stop = std::min(stride*(i+1), f.getChannelCount()) ;     
-      
-      td.channelBuffer = channelBuffers[i];
-
-      threads.push_back(std::unique_ptr<std::thread>(new std::thread(doEncode, td)));
-    }
-
-    /*Rejoin after processing this block*/
-    for(auto &t: threads) {
-      t->join();
+     CPU-bound (surprisingly little I/O waiting). So...let's get some more CPUs! 
+
+     The pool's workers live for the whole file, so we only pay for thread
+     startup once. Each block is first transposed (split into row tiles,
+     one per worker), then encoded one channel at a time; idle workers
+     steal either kind of task from the others, so any worker may encode
+     any channel. This thread does the reading, and can fill up to
+     prefetchBlocks() blocks ahead of the workers, so reading and encoding
+     overlap instead of taking turns. */
+
+  EncoderPool pool(encoders, f.getChannelCount(), columns, config.nThreads(),
+		   config.readSize(), config.prefetchBlocks() + 1);
+
+  std::exception_ptr readError;
+  try {
+    while(f.hasMoreData()) {
+      SampleBlock* block = pool.acquire();
+      block->datalen = 0;
+      try {
+	if(f.isMapped()) {
+	  block->datalen = f.readView(config.readSize(), block->samples);
+	} else {
+	  block->datalen = f.readData(config.readSize(), block->data);
+	  block->samples = reinterpret_cast<const char*>(block->data);
+	}
+      } catch(...) {
+	pool.submit(block); // Empty, so it just goes back on the free list
+	throw;
+      }
+      pool.submit(block);
     }
-  }
-  
-  for(auto e = encoders.begin(); e!=encoders.end(); e++)
-    (*e)->finish();
-  
-  for(auto i=0U; i<config.nThreads(); i++) {
-    delete[] channelBuffers[i];
+  } catch(...) {
+    readError = std::current_exception(); // Let the workers drain first
   }
 
-  delete[] channelBuffers;  
-  delete[] bulkBuffer;    
-}
+  pool.finish(); // Also finishes the encoders
 
-void doEncode(ThreadData d)  {
-  /* This takes the data and encodes it. It's meant to be called by a std::thread*/
-  for(auto chan = d.start; chan < d.stop; chan++) {
-    for(auto i=chan, j=0U; i<d.datalen*d.nChannels; i+=d.nChannels, j++) {
-      d.channelBuffer[j] = FLAC__int32(d.bulkBuffer[i]);
-    }
-    
-    const FLAC__int32* c = d.channelBuffer;
-    (*(d.e))[chan]->process(&c, d.datalen);
-  }   
+  if(readError)
+    std::rethrow_exception(readError);
 }
-
   
 
 
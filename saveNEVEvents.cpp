@@ -1,193 +1,281 @@
 
 struct EventSOA;
 
+#include <algorithm>
+#include <memory>
 #include <string>
 #include "NEVConfig.h"
 #include "NEVFile.h"
 #include "MatFile.h"
 #include "eventsoa.h"
+#include "nevwriter.h"
+#include "spool.h"
+#include "textwriter.h"
 
-void saveEventsCSV(const NEVConfig &config, const NEVFile &file, const EventSOA &ev) {
-
-  std::string filename = config.eventFilename(OutputFormat::CSV);
-  std::ofstream out(filename);
-  if(!out) {
-    throw(std::runtime_error("Unable to open " + filename + " for writing"));
-  }
-
-  double stampToSec =  1.0 / static_cast<double>(file.get_timestampFS());
-  
-  out << "timestamp,tic,reasoncode,parallel,sma1,sma2,sma3,sma4\n";
-  
-  for(unsigned i=0; i<ev.ts.size(); i++) {
-    out << ev.ts[i] * stampToSec << ','
-	<< ev.ts[i] << ','
-	<< (int) ev.reason[i]    << ','
-	<< ev.parallel[i]  << ','
-	<< ev.sma1[i]      << ','
-	<< ev.sma2[i]      << ','
-	<< ev.sma3[i]      << ','
-	<< ev.sma4[i]      << '\n';
-  }
-	
-  out.close();
-}
+namespace {
+
+  class EventsCSV : public EventWriter {
+  public:
+    EventsCSV(const NEVConfig &config, const NEVFile &file) :
+      filename(config.eventFilename(OutputFormat::CSV)),
+      out(filename),
+      text(out),
+      stampToSec(1.0 / static_cast<double>(file.get_timestampFS())),
+      nThreads(config.nThreads()) {
 
+      if(!out) {
+	throw(std::runtime_error("Unable to open " + filename + " for writing"));
+      }
+      text << "timestamp,tic,reasoncode,parallel,sma1,sma2,sma3,sma4\n";
+    }
 
-void saveEventsMatlab(const NEVConfig &config, const NEVFile &f, const EventSOA &ev) {
-  /* Pack event data into a MAT file. Most of this is a 1-1 mapping from EventSOA,
-     except that the SMA fields are condensed into Nx4 logical arrays.
-  */
-  
-  std::string filename = config.eventFilename(OutputFormat::MATLAB);  
-  MATFile m(filename, "wz");  
-
-
-  /* Write a basic header */
-  const char* header_fieldnames[] = {
-    "dataFile",       // 0
-    "captureMode",    // 1
-    "comment",        // 2
-    "creator",        // 3
-    "timeResolution", //4
-    "start_time_sys", //5
-    "start_time_proc" //6
+    void append(const EventSOA &ev) override {
+      formatRows(text, ev.size(), nThreads, [&](TextWriter &w, std::size_t begin, std::size_t end) {
+	  for(std::size_t i=begin; i<end; i++) {
+	    w << ev.ts[i] * stampToSec << ','
+	      << ev.ts[i] << ','
+	      << (int) ev.reason[i]    << ','
+	      << ev.parallel[i]  << ','
+	      << ev.sma1[i]      << ','
+	      << ev.sma2[i]      << ','
+	      << ev.sma3[i]      << ','
+	      << ev.sma4[i]      << '\n';
+	  }
+	});
+    }
+
+    void finish() override {
+      text.flush();
+      out.close();
+      if(!out) {
+	throw(std::runtime_error("Error while writing " + filename));
+      }
+    }
+
+  private:
+    std::string filename;
+    std::ofstream out;
+    TextWriter text;
+    double stampToSec;
+    unsigned nThreads;
   };
 
-  MW::mwSize header_dim[2] = {1, 1};
-  MW::mxArray* header = MW::mxCreateStructArray(2, header_dim, 7, header_fieldnames);
-  MW::mxSetFieldByNumber(header, 0, 0, MW::mxCreateString(config.input().c_str()));
-  MW::mxSetFieldByNumber(header, 0, 1, MW::mxCreateString(f.get_digital_mode() ?
-							  "parallel" : "serial"));
-  MW::mxSetFieldByNumber(header, 0, 2, MW::mxCreateString(f.get_comment().c_str()));
-  MW::mxSetFieldByNumber(header, 0, 3, MW::mxCreateString(f.get_creator().c_str()));
-  MW::mxSetFieldByNumber(header, 0, 4, MW::mxCreateDoubleScalar(static_cast<double>(f.get_timestampFS())));
-  MW::mxSetFieldByNumber(header, 0, 5, MW::mxCreateString(f.get_start_sys().str().c_str()));
-  MW::mxSetFieldByNumber(header, 0, 6, MW::mxCreateDoubleScalar(static_cast<double>(f.get_start_proc())));
-
-  m.putScalar("header", header);
-  MW::mxDestroyArray(header);
-			 
-  
-  MW::mwSize ndims = static_cast<MW::mwSize>(2);  
-  MW::mwSize dim1x[2] = { static_cast<MW::mwSize>(ev.ts.size()), 1}; // dims for Nx1 matrix
-  MW::mwSize dim4x[2] = { static_cast<MW::mwSize>(ev.ts.size()), 4}; // dims for Nx4 matrix (SMA)
-
-  // Write times in seconds and clock ticks
-  std::vector<double> time(ev.ts.size());
-  const double ticToSec = 1.0 / static_cast<double>(f.get_timestampFS());
-  for(size_t i=0; i<ev.ts.size(); i++) {
-    time[i] = double(ev.ts[i]) * ticToSec;
-  }
-  m.putArray("ts",  time.data(),   ndims, dim1x);
-  m.putArray("tic", ev.ts.data(),  ndims, dim1x);
-  
-  /* Cannot use a std::vector<bool> here because it doesn't 
-     provide access to ::data(). We over-allocate so that
-     we can reuse this buffer to put all 4 SMA into one matrix.
- */
-  auto bufSize = ev.reason.size() * 4;
-  bool* boolBuffer = new bool[bufSize];
-  
-  const std::string reason_str[8] = {
-    "is_parallel_change",
-    "is_sma1_change", "is_sma2_change", "is_sma3_change", "is_sma4_change", // This row are placeholders (skipped below)
-    "is_output_change", "is_periodic_sample", "is_serial_change"};
-  
-  for(int reason_id = 0; reason_id < 8; reason_id++) {
-    // Skip the SMA reasons and package them up separately later
-    if(reason_id > 0 && reason_id < 5)
-      continue;
-      
-    for(auto i=0; i < ev.reason.size(); i++) {
-      if(ev.reason[i] & (1 << reason_id))
-	boolBuffer[i] = true;
-      else
-	boolBuffer[i] = false;
+
+  class EventsMatlab : public EventWriter {
+    /* Pack event data into a MAT file. Most of this is a 1-1 mapping from EventSOA,
+       except that the SMA fields are condensed into Nx4 logical arrays.
+
+       Every variable needs the number of events up front, so the columns are
+       spooled to disk as they arrive and streamed into the file at the end.
+    */
+  public:
+    EventsMatlab(const NEVConfig &config, const NEVFile &_f) :
+      f(_f),
+      m(config.eventFilename(OutputFormat::MATLAB), "wz"),
+      n(0) {
+
+      /* Write a basic header */
+      const char* header_fieldnames[] = {
+	"dataFile",       // 0
+	"captureMode",    // 1
+	"comment",        // 2
+	"creator",        // 3
+	"timeResolution", //4
+	"start_time_sys", //5
+	"start_time_proc" //6
+      };
+
+      MW::mwSize header_dim[2] = {1, 1};
+      MW::mxArray* header = MW::mxCreateStructArray(2, header_dim, 7, header_fieldnames);
+      MW::mxSetFieldByNumber(header, 0, 0, MW::mxCreateString(config.input().c_str()));
+      MW::mxSetFieldByNumber(header, 0, 1, MW::mxCreateString(f.get_digital_mode() ?
+							      "parallel" : "serial"));
+      MW::mxSetFieldByNumber(header, 0, 2, MW::mxCreateString(f.get_comment().c_str()));
+      MW::mxSetFieldByNumber(header, 0, 3, MW::mxCreateString(f.get_creator().c_str()));
+      MW::mxSetFieldByNumber(header, 0, 4, MW::mxCreateDoubleScalar(static_cast<double>(f.get_timestampFS())));
+      MW::mxSetFieldByNumber(header, 0, 5, MW::mxCreateString(f.get_start_sys().str().c_str()));
+      MW::mxSetFieldByNumber(header, 0, 6, MW::mxCreateDoubleScalar(static_cast<double>(f.get_start_proc())));
+
+      m.putScalar("header", header);
+      MW::mxDestroyArray(header);
     }
 
-    m.putArray(reason_str[reason_id], boolBuffer, ndims, dim1x);
-  }
-  
-  /* Pack the SMA changes into a single matrix */
-  std::fill(boolBuffer, boolBuffer+bufSize, false);
-  for(int sma_id=0; sma_id<4; sma_id++) {
-    auto offset = ev.reason.size() * sma_id;
-    std::transform(ev.reason.begin(), ev.reason.end(),
-		   boolBuffer + offset, 
-      [sma_id](DigitalReason r) -> bool {return static_cast<bool>(r & (1 << (1 + sma_id)));});
-  }
-
-  m.putArray("is_sma_change", boolBuffer, ndims, dim4x);   
-    
-  m.putArray("parallel_value", ev.parallel.data(), ndims, dim1x);
-
-  /* Pack SMA values into a single matrix */
-  std::fill(boolBuffer, boolBuffer+bufSize, false);
-  std::transform(ev.sma1.begin(), ev.sma1.end(), boolBuffer,
-		 [](std::uint16_t s) -> bool { return s !=0;});
-  std::transform(ev.sma2.begin(), ev.sma2.end(), boolBuffer + ev.sma1.size(),
-		 [](std::uint16_t s) -> bool { return s !=0;});
-  std::transform(ev.sma3.begin(), ev.sma3.end(), boolBuffer + 2*ev.sma1.size(),
-		 [](std::uint16_t s) -> bool { return s !=0;});
-  std::transform(ev.sma4.begin(), ev.sma4.end(), boolBuffer + 3*ev.sma1.size(),
-		 [](std::uint16_t s) -> bool { return s !=0;});
-
-  m.putArray("sma_value", boolBuffer, ndims, dim4x);
-
-  delete [] boolBuffer;
-}
+    void append(const EventSOA &ev) override {
+      ts.write(ev.ts);
+      reason.write(ev.reason);
+      parallel.write(ev.parallel);
+      sma[0].write(ev.sma1);
+      sma[1].write(ev.sma2);
+      sma[2].write(ev.sma3);
+      sma[3].write(ev.sma4);
+      n += ev.size();
+    }
+
+    void finish() override {
+      MW::mwSize ndims = static_cast<MW::mwSize>(2);
+      MW::mwSize dim1x[2] = { static_cast<MW::mwSize>(n), 1}; // dims for Nx1 matrix
+      MW::mwSize dim4x[2] = { static_cast<MW::mwSize>(n), 4}; // dims for Nx4 matrix (SMA)
+
+      // Write times in seconds and clock ticks
+      const double ticToSec = 1.0 / static_cast<double>(f.get_timestampFS());
+      {
+	auto out = m.openArray<double>("ts", ndims, dim1x);
+	convert<std::uint32_t>(ts, out, [ticToSec](std::uint32_t t) { return double(t) * ticToSec; });
+	out.close();
+      }
+      {
+	auto out = m.openArray<std::uint32_t>("tic", ndims, dim1x);
+	ts.replay<std::uint32_t>([&out](const std::uint32_t* v, std::size_t k) { out.append(v, k); });
+	out.close();
+      }
+
+      const std::string reason_str[8] = {
+	"is_parallel_change",
+	"is_sma1_change", "is_sma2_change", "is_sma3_change", "is_sma4_change", // This row are placeholders (skipped below)
+	"is_output_change", "is_periodic_sample", "is_serial_change"};
+
+      for(int reason_id = 0; reason_id < 8; reason_id++) {
+	// Skip the SMA reasons and package them up separately later
+	if(reason_id > 0 && reason_id < 5)
+	  continue;
+
+	auto out = m.openArray<bool>(reason_str[reason_id], ndims, dim1x);
+	convert<DigitalReason>(reason, out, [reason_id](DigitalReason r) -> bool {return (r & (1 << reason_id)) != 0;});
+	out.close();
+      }
+
+      /* Pack the SMA changes into a single matrix, one column after another */
+      {
+	auto out = m.openArray<bool>("is_sma_change", ndims, dim4x);
+	for(int sma_id=0; sma_id<4; sma_id++) {
+	  convert<DigitalReason>(reason, out, [sma_id](DigitalReason r) -> bool {return (r & (1 << (1 + sma_id))) != 0;});
+	}
+	out.close();
+      }
 
+      {
+	auto out = m.openArray<std::uint16_t>("parallel_value", ndims, dim1x);
+	parallel.replay<std::uint16_t>([&out](const std::uint16_t* v, std::size_t k) { out.append(v, k); });
+	out.close();
+      }
 
-void saveEventsText(const NEVConfig &config, const NEVFile &file, const EventSOA &ev) {
+      /* Pack SMA values into a single matrix */
+      {
+	auto out = m.openArray<bool>("sma_value", ndims, dim4x);
+	for(auto &s : sma) {
+	  convert<std::int16_t>(s, out, [](std::int16_t v) -> bool { return v != 0;});
+	}
+	out.close();
+      }
+    }
 
-  const double stampToSec =  1.0 / static_cast<double>(file.get_timestampFS());
-  const static std::string reason_str[8] = {
-    "Parallel",
-    "SMA #1", "SMA #2", "SMA #3", "SMA #4",
-    "Output", "Periodic", "Serial"
+  private:
+    /* Replays src's values (of In's type) through fn and into out */
+    template <typename In, typename Out, typename Fn>
+    void convert(Spool &src, MATArrayStream<Out> &out, Fn fn) {
+      const std::size_t CHUNK = 1 << 16;
+      std::unique_ptr<Out[]> buffer(new Out[CHUNK]);
+      src.replay<In>([&](const In* v, std::size_t k) {
+	  std::transform(v, v + k, buffer.get(), fn);
+	  out.append(buffer.get(), k);
+	}, CHUNK);
+    }
+
+    const NEVFile &f;
+    MATFile m;
+    std::size_t n;
+
+    Spool ts;        // uint32
+    Spool reason;    // DigitalReason
+    Spool parallel;  // uint16
+    Spool sma[4];    // int16
   };
-  
-  std::string filename = config.eventFilename(OutputFormat::TEXT);
-
-  
-  std::ofstream out(filename);
-  if(!out) {
-    throw(std::runtime_error("Unable to open " + filename + " for writing."));
-  }
-  
-  out << "Digital events from " << config.input() << "\n"
-      << "Capture mode: " << file.get_digital_mode() << "\n"
-      << "Timestamp Resolution: " << file.get_timestampFS() << "\n"
-      << "System time: " << file.get_start_sys() << "\n"
-      << "Processor time: " << file.get_start_proc() << "\n"
-      << "Comment: " << file.get_comment() << "\n"
-      << "Creator: " << file.get_creator() << "\n"
-      << "\n\n";          
-    
-  for(unsigned i=0; i<ev.ts.size(); i++) {
-    out << "Event at " << (double) ev.ts[i] * stampToSec
-	<< " (tic " << ev.ts[i] << ")\n";
-
-    // Print reason as a code and text  
-    bool first = true;
-    for(int reason_id=0; reason_id < 8; reason_id++) {
-      if((int)ev.reason[i] & (1 << reason_id)) {
-	out << (first ? "\tReason: " : " & ") << reason_str[reason_id];
-
-	if(first)
-	  first = false;
 
+
+  class EventsText : public EventWriter {
+  public:
+    EventsText(const NEVConfig &config, const NEVFile &file) :
+      filename(config.eventFilename(OutputFormat::TEXT)),
+      out(filename),
+      text(out),
+      stampToSec(1.0 / static_cast<double>(file.get_timestampFS())),
+      nThreads(config.nThreads()) {
+
+      if(!out) {
+	throw(std::runtime_error("Unable to open " + filename + " for writing."));
+      }
+
+      // Straight to out, since the header has a few types text can't do
+      out << "Digital events from " << config.input() << "\n"
+	  << "Capture mode: " << file.get_digital_mode() << "\n"
+	  << "Timestamp Resolution: " << file.get_timestampFS() << "\n"
+	  << "System time: " << file.get_start_sys() << "\n"
+	  << "Processor time: " << file.get_start_proc() << "\n"
+	  << "Comment: " << file.get_comment() << "\n"
+	  << "Creator: " << file.get_creator() << "\n"
+	  << "\n\n";
+    }
+
+    void append(const EventSOA &ev) override {
+      const static std::string reason_str[8] = {
+	"Parallel",
+	"SMA #1", "SMA #2", "SMA #3", "SMA #4",
+	"Output", "Periodic", "Serial"
+      };
+
+      formatRows(text, ev.size(), nThreads, [&](TextWriter &w, std::size_t begin, std::size_t end) {
+	  for(std::size_t i=begin; i<end; i++) {
+	    w << "Event at " << (double) ev.ts[i] * stampToSec
+	      << " (tic " << ev.ts[i] << ")\n";
+
+	    // Print reason as a code and text
+	    bool first = true;
+	    for(int reason_id=0; reason_id < 8; reason_id++) {
+	      if((int)ev.reason[i] & (1 << reason_id)) {
+		w << (first ? "\tReason: " : " & ") << reason_str[reason_id];
+
+		if(first)
+		  first = false;
+
+	      }
+	    }
+	    w << "\n";
+
+	    // Actual channel values
+	    w << "\tParallel: " << ev.parallel[i] << "\n";
+	    w << "\tSMA: " << ev.sma1[i] << " " << ev.sma2[i] << " "
+	      << ev.sma3[i] << " " << ev.sma4[i] << "\n";
+	    w << "\n";
+	  }
+	});
+    }
+
+    void finish() override {
+      text.flush();
+      out.close();
+      if(!out) {
+	throw(std::runtime_error("Error while writing " + filename));
       }
     }
-    out << "\n";
 
-    // Actual channel values
-    out << "\tParallel: " << ev.parallel[i] << "\n";
-    out << "\tSMA: " << ev.sma1[i] << " " << ev.sma2[i] << " "
-	             << ev.sma3[i] << " " << ev.sma4[i] << "\n";
-    out << "\n";
-  }
+  private:
+    std::string filename;
+    std::ofstream out;
+    TextWriter text;
+    double stampToSec;
+    unsigned nThreads;
+  };
+}
+
+
+std::unique_ptr<EventWriter> openEventsCSV(const NEVConfig &config, const NEVFile &file) {
+  return std::unique_ptr<EventWriter>(new EventsCSV(config, file));
+}
+
+std::unique_ptr<EventWriter> openEventsMatlab(const NEVConfig &config, const NEVFile &file) {
+  return std::unique_ptr<EventWriter>(new EventsMatlab(config, file));
+}
 
-  out.close();
+std::unique_ptr<EventWriter> openEventsText(const NEVConfig &config, const NEVFile &file) {
+  return std::unique_ptr<EventWriter>(new EventsText(config, file));
 }
@@ -0,0 +1,560 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "NEVConfig.h"
+#include "NEVFile.h"
+#include "MatFile.h"
+#include "nevwriter.h"
+#include "packetsoa.h"
+#include "spool.h"
+#include "textwriter.h"
+#include "waveform.h"
+
+/* Writers for the spikes detected (and sorted) online. All of them work
+   electrode by electrode: each electrode's spike times, units and,
+   optionally, waveforms are written together, in time order. Since the
+   NEV file is in time order, spikes are spooled to a temporary file as
+   they're read and sorted out by electrode at the end.
+
+   Waveforms are converted to volts using the electrode's NEUEVWAV header,
+   except in the binary file, which keeps the raw samples (and the scale
+   factor) to stay small. A waveform that is shorter than the electrode's
+   longest is padded with NaN (zero in the binary file).
+
+   The binary file (-online-spikes.bin) is little-endian, and laid out as:
+     char[8]  "NEVSPIKE"
+     uint32   format version (1)
+     uint32   timestamp resolution (ticks/sec)
+     uint32   waveform sampling rate (samples/sec)
+     uint32   1 if waveforms are included, 0 otherwise
+     uint32   number of electrodes
+   followed by a block for each electrode:
+     uint16   electrode ID
+     uint8    bytes per sample
+     uint8    (reserved)
+     uint32   samples per waveform (0 if waveforms aren't included)
+     float    volts per bit
+     uint64   number of spikes (N)
+     uint32   timestamp of each spike, in ticks [N]
+     uint8    unit of each spike [N]
+     int      raw waveforms, one spike after another [N * samples per waveform]
+*/
+
+namespace {
+
+  /* Each spike is spooled as a SpikeRecord, then its waveform (len bytes).
+     The fields are written packed (RECORD_SIZE bytes), so no uninitialized
+     padding ever reaches the spool. */
+  struct SpikeRecord {
+    std::uint32_t ts;
+    std::uint32_t len;
+    std::uint8_t unit;
+  };
+
+  const std::size_t RECORD_SIZE = sizeof(std::uint32_t) + sizeof(std::uint32_t) + sizeof(std::uint8_t);
+
+
+  const std::size_t NO_SLOT = std::numeric_limits<std::size_t>::max();
+  const std::size_t SPOOL_BLOCK = 1 << 16;  // Bytes buffered per electrode
+
+
+  struct ElectrodeSpikes {
+    std::uint16_t electrode;
+    std::uint8_t bytesPerSample;
+    double scale;                   // Volts per bit
+    std::size_t n;                  // Number of spikes
+    std::size_t nSamples;           // Longest waveform on this electrode
+    std::vector<char> pending;      // Records that haven't been spooled yet
+    std::vector<std::pair<std::uint64_t, std::size_t> > blocks;  // Offset and size of the spooled ones
+  };
+
+
+  /* Sorts spikes by electrode without keeping them in memory. Records
+     collect in a small buffer per electrode, which is moved to one shared
+     spool whenever it fills up, so reading an electrode back just means
+     visiting its blocks in order. */
+  class SpikeSpool {
+  public:
+    SpikeSpool(const NEVFile &_file, bool _keepWaves) :
+      file(_file),
+      keepWaves(_keepWaves),
+      slot(std::numeric_limits<std::uint16_t>::max() + 1, NO_SLOT) {
+    }
+
+    void append(const SpikeSOA &sp) {
+      for(std::size_t i = 0; i < sp.size(); i++) {
+	ElectrodeSpikes &g = electrode(sp.electrode[i]);
+
+	SpikeRecord r{sp.ts[i], keepWaves ? sp.len[i] : 0, sp.unit[i]};
+	g.nSamples = std::max<std::size_t>(g.nSamples, sp.len[i] / g.bytesPerSample);
+	g.n++;
+
+	if(g.pending.size() + RECORD_SIZE + r.len > SPOOL_BLOCK && !g.pending.empty()) {
+	  g.blocks.push_back(std::make_pair(spool.size(), g.pending.size()));
+	  spool.write(g.pending);
+	  g.pending.clear();
+	}
+
+	char rec[RECORD_SIZE];
+	std::memcpy(rec, &r.ts, sizeof(r.ts));
+	std::memcpy(rec + sizeof(r.ts), &r.len, sizeof(r.len));
+	std::memcpy(rec + sizeof(r.ts) + sizeof(r.len), &r.unit, sizeof(r.unit));
+	g.pending.insert(g.pending.end(), rec, rec + RECORD_SIZE);
+	g.pending.insert(g.pending.end(), sp.waveform(i), sp.waveform(i) + r.len);
+      }
+    }
+
+    /* Every electrode with spikes, in order of ID */
+    std::vector<const ElectrodeSpikes*> electrodes() const {
+      std::vector<const ElectrodeSpikes*> sorted;
+      for(const auto &g : groups)
+	sorted.push_back(&g);
+      std::sort(sorted.begin(), sorted.end(),
+		[](const ElectrodeSpikes* a, const ElectrodeSpikes* b) { return a->electrode < b->electrode; });
+      return sorted;
+    }
+
+    /* Calls fn(const SpikeRecord&, const char* waveform) on each of g's spikes, in time order */
+    template <typename Fn>
+    void replay(const ElectrodeSpikes &g, Fn &&fn) {
+      for(const auto &b : g.blocks) {
+	block.resize(b.second);
+	spool.seek(b.first);
+	if(spool.read(block.data(), b.second) != b.second)
+	  throw(std::runtime_error("Temporary spike file is truncated"));
+	parse(block.data(), b.second, fn);
+      }
+      parse(g.pending.data(), g.pending.size(), fn);
+    }
+
+  private:
+    ElectrodeSpikes& electrode(std::uint16_t e) {
+      /* A slot for every possible electrode ID keeps the lookup cheap */
+      if(slot[e] == NO_SLOT) {
+	ElectrodeSpikes g{e, 0, 0.0, 0, 0, {}, {}};
+	try {
+	  SpikeHeader h = file.spikeChannels_cfind(e);
+	  g.bytesPerSample = file.allWaves16Bit() ? 2 : h.bytesPerSample;
+	  g.scale = h.scaleFactor;
+	} catch(const std::out_of_range &) {
+	  throw(std::runtime_error("No NEUEVWAV header for spike electrode " + std::to_string(e)));
+	}
+	if(g.bytesPerSample == 0)
+	  throw(std::runtime_error("Spike electrode " + std::to_string(e) + " has 0 bytes per sample"));
+
+	g.pending.reserve(SPOOL_BLOCK);
+	slot[e] = groups.size();
+	groups.push_back(std::move(g));
+      }
+      return groups[slot[e]];
+    }
+
+    template <typename Fn>
+    static void parse(const char* data, std::size_t size, Fn &fn) {
+      for(std::size_t pos = 0; pos < size; ) {
+	SpikeRecord r;
+	std::memcpy(&r.ts, data + pos, sizeof(r.ts));
+	std::memcpy(&r.len, data + pos + sizeof(r.ts), sizeof(r.len));
+	std::memcpy(&r.unit, data + pos + sizeof(r.ts) + sizeof(r.len), sizeof(r.unit));
+	fn(static_cast<const SpikeRecord&>(r), data + pos + RECORD_SIZE);
+	pos += RECORD_SIZE + r.len;
+      }
+    }
+
+    const NEVFile &file;
+    const bool keepWaves;
+    std::vector<std::size_t> slot;
+    std::vector<ElectrodeSpikes> groups;
+    Spool spool;
+    std::vector<char> block;
+  };
+
+
+  /* Fills dest (g.nSamples long) with a len-byte waveform from g, in volts */
+  void decodeWaveform(const char* wave, std::size_t len, const ElectrodeSpikes &g, double* dest) {
+    ::decodeWaveform(wave, len, g.bytesPerSample, g.scale, g.nSamples, dest);
+  }
+
+
+  /* Opens filename with a large buffer, since these files get big */
+  void openBuffered(std::ofstream &out, std::vector<char> &buffer, const std::string &filename,
+		    std::ios::openmode mode = std::ios::out) {
+    buffer.resize(1 << 22);
+    out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    out.open(filename, mode);
+    if(!out) {
+      throw(std::runtime_error("Unable to open " + filename + " for writing."));
+    }
+  }
+
+
+  void closeChecked(std::ofstream &out, const std::string &filename) {
+    out.close();
+    if(!out) {
+      throw(std::runtime_error("Error while writing " + filename));
+    }
+  }
+
+
+  template <typename T>
+  void writeRaw(std::ostream &out, const T &value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+
+  template <typename T>
+  void writeRaw(std::ostream &out, const std::vector<T> &values) {
+    out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+  }
+
+
+  /* One output format. The file is opened when it's made, so problems
+     show up before the NEV file is read, and written all at once by write() */
+  class SpikeFormat {
+  public:
+    SpikeFormat(const NEVConfig &_config, const NEVFile &_file) :
+      config(_config), file(_file) {
+    }
+    virtual ~SpikeFormat() { }
+    virtual void write(SpikeSpool &spikes) = 0;
+
+  protected:
+    const NEVConfig &config;
+    const NEVFile &file;
+  };
+
+
+  class SpikesText : public SpikeFormat {
+  public:
+    SpikesText(const NEVConfig &config, const NEVFile &file) :
+      SpikeFormat(config, file),
+      filename(config.spikeFilename(OutputFormat::TEXT)) {
+
+      openBuffered(out, buffer, filename);
+      out << "Online-sorted spikes from " << config.input() << "\n\n";
+    }
+
+    void write(SpikeSpool &spikes) override {
+      const double stampToSec =  1.0 / static_cast<double>(file.get_timestampFS());
+
+      TextWriter text(out);
+      std::vector<double> wave;
+      for(const auto g : spikes.electrodes()) {
+	text << "Electrode " << g->electrode << ": " << g->n << " spikes\n";
+
+	wave.resize(g->nSamples);
+	spikes.replay(*g, [&](const SpikeRecord &r, const char* w) {
+	    text << "\t- Spike at t=" << r.ts * stampToSec
+		 << "sec (tick " << r.ts << "), unit " << int(r.unit) << "\n";
+
+	    if(config.includeSpikeWaves()) {
+	      decodeWaveform(w, r.len, *g, wave.data());
+	      text << "\t\tWaveform (V): [";
+	      for(std::size_t i = 0; i < wave.size(); i++)
+		text << (i ? "," : "") << wave[i];
+	      text << "]\n";
+	    }
+	  });
+	text << "\n";
+      }
+      text.flush();
+      closeChecked(out, filename);
+    }
+
+  private:
+    std::string filename;
+    std::vector<char> buffer;
+    std::ofstream out;
+  };
+
+
+  class SpikesCSV : public SpikeFormat {
+  public:
+    SpikesCSV(const NEVConfig &config, const NEVFile &file) :
+      SpikeFormat(config, file),
+      filename(config.spikeFilename(OutputFormat::CSV)) {
+
+      openBuffered(out, buffer, filename);
+      out << "Time,Tic,Electrode,Unit";
+      if(config.includeSpikeWaves())
+	out << ",Waveform";
+      out << "\n";
+    }
+
+    void write(SpikeSpool &spikes) override {
+      const double stampToSec =  1.0 / static_cast<double>(file.get_timestampFS());
+
+      TextWriter text(out);
+      std::vector<double> wave;
+      for(const auto g : spikes.electrodes()) {
+	wave.resize(g->nSamples);
+	spikes.replay(*g, [&](const SpikeRecord &r, const char* w) {
+	    text << r.ts * stampToSec << ','
+		 << r.ts << ','
+		 << g->electrode << ','
+		 << int(r.unit);
+
+	    if(config.includeSpikeWaves()) {
+	      decodeWaveform(w, r.len, *g, wave.data());
+	      for(auto v : wave)
+		text << ',' << v;
+	    }
+	    text << "\n";
+	  });
+      }
+      text.flush();
+      closeChecked(out, filename);
+    }
+
+  private:
+    std::string filename;
+    std::vector<char> buffer;
+    std::ofstream out;
+  };
+
+
+  class SpikesMatlab : public SpikeFormat {
+    /* One set of variables per electrode (elec<ID>_waveform, _tick, _time
+       and _unit), rather than a struct per spike. Each electrode's spikes
+       are read back once: the waveforms are streamed into the file in
+       chunks, so they never have to fit in memory, while the ticks and
+       units (5 bytes a spike) are collected and written after them. */
+  public:
+    SpikesMatlab(const NEVConfig &config, const NEVFile &file) :
+      SpikeFormat(config, file),
+      m(config.spikeFilename(OutputFormat::MATLAB), "wz") {
+
+      const char* header_fieldnames[] = {
+	"dataFile",           // 0
+	"timeResolution",     // 1
+	"waveformResolution"  // 2
+      };
+      MW::mxArray* header = MW::mxCreateStructArray(2, MW::SCALAR_SIZE, 3, header_fieldnames);
+      MW::mxSetFieldByNumber(header, 0, 0, MW::mxCreateString(config.input().c_str()));
+      MW::mxSetFieldByNumber(header, 0, 1, MW::mxCreateDoubleScalar(static_cast<double>(file.get_timestampFS())));
+      MW::mxSetFieldByNumber(header, 0, 2, MW::mxCreateDoubleScalar(static_cast<double>(file.get_waveformFS())));
+      m.putScalar("header", header);
+      MW::mxDestroyArray(header);
+    }
+
+    void write(SpikeSpool &spikes) override {
+      const double stampToSec =  1.0 / static_cast<double>(file.get_timestampFS());
+      auto groups = spikes.electrodes();
+
+      std::vector<std::uint16_t> electrodes;
+      for(const auto g : groups)
+	electrodes.push_back(g->electrode);
+      MW::mwSize edims[2] = { static_cast<MW::mwSize>(electrodes.size()), 1 };
+      m.putArray("electrodes", electrodes, 2, edims);
+
+      for(const auto g : groups) {
+	const std::string prefix = "elec" + std::to_string(g->electrode) + "_";
+
+	ticks.clear();
+	units.clear();
+	ticks.reserve(g->n);
+	units.reserve(g->n);
+
+	if(config.includeSpikeWaves()) {
+	  /* The raw waveforms are gathered a chunk at a time, padded to the
+	     same length, and converted together */
+	  const std::size_t CHUNK = 4096;  // Spikes per chunk
+	  const std::size_t stride = g->nSamples * g->bytesPerSample;
+	  MW::mwSize wdims[2] = { static_cast<MW::mwSize>(g->nSamples), static_cast<MW::mwSize>(g->n) };
+	  auto stream = m.openArray<double>(prefix + "waveform", 2, wdims);
+
+	  raw.resize(CHUNK * stride);
+	  lengths.resize(CHUNK);
+	  wave.resize(CHUNK * g->nSamples);
+	  std::size_t count = 0;
+	  auto flush = [&]() {
+	    decodeWaveforms(raw.data(), lengths.data(), count, g->bytesPerSample, g->scale,
+			    g->nSamples, wave.data());
+	    stream.append(wave.data(), count * g->nSamples);
+	    count = 0;
+	  };
+
+	  spikes.replay(*g, [&](const SpikeRecord &r, const char* w) {
+	      ticks.push_back(r.ts);
+	      units.push_back(r.unit);
+
+	      const std::size_t len = std::min<std::size_t>(r.len, stride);
+	      std::memcpy(raw.data() + count * stride, w, len);
+	      lengths[count] = static_cast<std::uint32_t>(len / g->bytesPerSample);
+	      if(++count == CHUNK)
+		flush();
+	    });
+	  flush();
+	  stream.close();
+	} else {
+	  spikes.replay(*g, [&](const SpikeRecord &r, const char*) {
+	      ticks.push_back(r.ts);
+	      units.push_back(r.unit);
+	    });
+	}
+
+	times.resize(ticks.size());
+	std::transform(ticks.begin(), ticks.end(), times.begin(),
+		       [stampToSec](std::uint32_t t) { return t * stampToSec; });
+
+	MW::mwSize dims[2] = { static_cast<MW::mwSize>(g->n), 1 };
+	m.putArray(prefix + "tick", ticks, 2, dims);
+	m.putArray(prefix + "time", times, 2, dims);
+	m.putArray(prefix + "unit", units, 2, dims);
+      }
+    }
+
+  private:
+    MATFile m;
+    std::vector<std::uint32_t> ticks;
+    std::vector<double> times;
+    std::vector<std::uint8_t> units;
+    std::vector<char> raw;              // A chunk of waveforms
+    std::vector<std::uint32_t> lengths; // and their lengths, in samples
+    std::vector<double> wave;
+  };
+
+
+  class SpikesBinary : public SpikeFormat {
+    /* See the top of this file for the layout */
+  public:
+    SpikesBinary(const NEVConfig &config, const NEVFile &file) :
+      SpikeFormat(config, file),
+      filename(config.spikeFilename(OutputFormat::BINARY)) {
+
+      openBuffered(out, buffer, filename, std::ios::out | std::ios::binary);
+    }
+
+    void write(SpikeSpool &spikes) override {
+      const bool waves = config.includeSpikeWaves();
+      auto groups = spikes.electrodes();
+
+      out.write("NEVSPIKE", 8);
+      writeRaw<std::uint32_t>(out, 1);
+      writeRaw<std::uint32_t>(out, file.get_timestampFS());
+      writeRaw<std::uint32_t>(out, file.get_waveformFS());
+      writeRaw<std::uint32_t>(out, waves ? 1 : 0);
+      writeRaw<std::uint32_t>(out, static_cast<std::uint32_t>(groups.size()));
+
+      for(const auto g : groups) {
+	const std::size_t waveBytes = g->nSamples * g->bytesPerSample;
+
+	writeRaw<std::uint16_t>(out, g->electrode);
+	writeRaw<std::uint8_t>(out, g->bytesPerSample);
+	writeRaw<std::uint8_t>(out, 0);
+	writeRaw<std::uint32_t>(out, waves ? static_cast<std::uint32_t>(g->nSamples) : 0);
+	writeRaw<float>(out, static_cast<float>(g->scale));
+	writeRaw<std::uint64_t>(out, g->n);
+
+	/* The spikes are read back once. The timestamps and units are
+	   collected and the waveforms written in chunks as they go by, so with
+	   waveforms, space is left for the two columns and they're filled in
+	   afterwards */
+	ticks.clear();
+	units.clear();
+	ticks.reserve(g->n);
+	units.reserve(g->n);
+
+	const std::streampos columns = out.tellp();
+	if(waves)
+	  out.seekp(columns + std::streamoff(g->n * (sizeof(std::uint32_t) + sizeof(std::uint8_t))));
+
+	const std::size_t CHUNK = 4096;  // Spikes per chunk
+	raw.resize(waves ? CHUNK * waveBytes : 0);
+	std::size_t count = 0;
+	spikes.replay(*g, [&](const SpikeRecord &r, const char* w) {
+	    ticks.push_back(r.ts);
+	    units.push_back(r.unit);
+
+	    if(waves) {
+	      /* Waveforms are already raw bytes, so just pad them to the same length */
+	      char* dest = raw.data() + count * waveBytes;
+	      std::size_t len = std::min<std::size_t>(r.len, waveBytes);
+	      std::memcpy(dest, w, len);
+	      std::fill(dest + len, dest + waveBytes, 0);
+	      if(++count == CHUNK) {
+		out.write(raw.data(), count * waveBytes);
+		count = 0;
+	      }
+	    }
+	  });
+
+	if(waves) {
+	  out.write(raw.data(), count * waveBytes);
+	  const std::streampos end = out.tellp();
+	  out.seekp(columns);
+	  writeRaw(out, ticks);
+	  writeRaw(out, units);
+	  out.seekp(end);
+	} else {
+	  writeRaw(out, ticks);
+	  writeRaw(out, units);
+	}
+      }
+
+      closeChecked(out, filename);
+    }
+
+  private:
+    std::string filename;
+    std::vector<char> buffer;
+    std::ofstream out;
+    std::vector<char> raw;             // A chunk of waveforms
+    std::vector<std::uint32_t> ticks;  // One electrode's columns
+    std::vector<std::uint8_t> units;
+  };
+
+
+  /* Every format is written electrode by electrode, so the spikes are
+     spooled once as they come in, and each format is written in finish() */
+  class SpikeFiles : public SpikeWriter {
+  public:
+    SpikeFiles(const NEVConfig &config, const NEVFile &file) :
+      spikes(file, config.includeSpikeWaves()) {
+
+      for(auto fmt : config.spikeFileTypes()) {
+	switch(fmt) {
+	case OutputFormat::TEXT:
+	  formats.emplace_back(new SpikesText(config, file));
+	  break;
+	case OutputFormat::CSV:
+	  formats.emplace_back(new SpikesCSV(config, file));
+	  break;
+	case OutputFormat::MATLAB:
+	  formats.emplace_back(new SpikesMatlab(config, file));
+	  break;
+	case OutputFormat::BINARY:
+	  formats.emplace_back(new SpikesBinary(config, file));
+	  break;
+	default:
+	  throw(std::runtime_error("Method not (yet) implemented"));
+	}
+      }
+    }
+
+    void append(const SpikeSOA &sp) override { spikes.append(sp); }
+
+    void finish() override {
+      for(auto &f : formats)
+	f->write(spikes);
+    }
+
+  private:
+    SpikeSpool spikes;
+    std::vector<std::unique_ptr<SpikeFormat> > formats;
+  };
+}
+
+
+/* One writer for all of the spike file types in config */
+std::unique_ptr<SpikeWriter> openSpikes(const NEVConfig &config, const NEVFile &file) {
+  return std::unique_ptr<SpikeWriter>(new SpikeFiles(config, file));
+}
@@ -0,0 +1,76 @@
+#include <stdexcept>
+#include <utility>
+
+#include "spool.h"
+
+namespace {
+  /* Spools routinely pass 2 GB, which plain fseek can't reach everywhere */
+  int seek64(std::FILE* fp, std::uint64_t offset, int whence) {
+#ifdef _WIN32
+    return _fseeki64(fp, static_cast<__int64>(offset), whence);
+#else
+    return fseeko(fp, static_cast<off_t>(offset), whence);
+#endif
+  }
+}
+
+
+Spool::Spool() : fp(std::tmpfile()), bytes(0), writing(true) {
+  if(!fp)
+    throw(std::runtime_error("Unable to create a temporary file"));
+  std::setvbuf(fp, nullptr, _IOFBF, 1 << 20);
+}
+
+
+Spool::~Spool() {
+  if(fp)
+    std::fclose(fp);
+}
+
+
+Spool::Spool(Spool &&rhs) noexcept : fp(rhs.fp), bytes(rhs.bytes), writing(rhs.writing) {
+  rhs.fp = nullptr;
+  rhs.bytes = 0;
+}
+
+
+Spool& Spool::operator=(Spool &&rhs) noexcept {
+  std::swap(fp, rhs.fp);
+  std::swap(bytes, rhs.bytes);
+  std::swap(writing, rhs.writing);
+  return *this;
+}
+
+
+void Spool::write(const void* data, std::size_t n) {
+  if(n == 0)
+    return;
+
+  if(!writing) {
+    if(seek64(fp, 0, SEEK_END) != 0)
+      throw(std::runtime_error("Unable to seek in temporary file"));
+    writing = true;
+  }
+
+  if(std::fwrite(data, 1, n, fp) != n)
+    throw(std::runtime_error("Unable to write to temporary file (is the disk full?)"));
+  bytes += n;
+}
+
+
+void Spool::seek(std::uint64_t offset) {
+  if(seek64(fp, offset, SEEK_SET) != 0)
+    throw(std::runtime_error("Unable to seek in temporary file"));
+  writing = false;
+}
+
+
+std::size_t Spool::read(void* data, std::size_t n) {
+  if(writing)
+    throw(std::logic_error("Spool: seek() before reading"));
+
+  std::size_t got = std::fread(data, 1, n, fp);
+  if(got < n && std::ferror(fp))
+    throw(std::runtime_error("Unable to read from temporary file"));
+  return got;
+}
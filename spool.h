@@ -0,0 +1,57 @@
+#pragma once
+#ifndef SPOOL_H_INCLUDED
+#define SPOOL_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+/* Spool: an anonymous temporary file, for data that has to be written out
+   in a different order than it arrives in, or only once its size is known.
+   write() always appends; seek() and read() can be mixed in freely. The
+   file is deleted when the spool is destroyed.
+*/
+class Spool {
+public:
+  Spool();
+  ~Spool();
+
+  Spool(const Spool &rhs) = delete;
+  Spool& operator=(const Spool &rhs) = delete;
+  Spool(Spool &&rhs) noexcept;
+  Spool& operator=(Spool &&rhs) noexcept;
+
+  void write(const void* data, std::size_t bytes);
+  template <typename T> void write(const std::vector<T> &values) {
+    write(values.data(), values.size() * sizeof(T));
+  }
+
+  std::uint64_t size() const { return bytes; }
+
+  void seek(std::uint64_t offset);
+  std::size_t read(void* data, std::size_t bytes);  // Short only at the end
+
+  /* Reads everything back from the start, calling fn(const T* values, n)
+     on up to chunk values at a time */
+  template <typename T, typename Fn>
+  void replay(Fn &&fn, std::size_t chunk = 1 << 16);
+
+private:
+  std::FILE* fp;
+  std::uint64_t bytes;
+  bool writing;  // Positioned at the end, ready to append
+};
+
+
+template <typename T, typename Fn>
+void Spool::replay(Fn &&fn, std::size_t chunk) {
+  std::vector<T> buffer(chunk);
+  std::size_t n;
+
+  seek(0);
+  while((n = read(buffer.data(), chunk * sizeof(T)) / sizeof(T)) > 0)
+    fn(static_cast<const T*>(buffer.data()), n);
+}
+
+#endif
@@ -0,0 +1,73 @@
+/* Times MATFile::putArray against the element-by-element copy it used to do.
+
+   Usage: MatFile-bench [filename] [elements]
+   The defaults are /dev/null (so the disk doesn't dominate) and 10^8 elements.
+   Files are written uncompressed ("w"), for the same reason. */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "MatFile.h"
+
+typedef std::chrono::steady_clock Clock;
+
+double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+
+template <typename Scalar>
+void putArrayOneByOne(MATFile& m, const std::string& varname, const std::vector<Scalar>& values,
+                      MW::mwSize ndims, const MW::mwSize* dims) {
+    /* What putArray did before: build an mxArray, then copy into it */
+    MW::mxArray* newval = MW::mxCreateNumericArray(ndims, dims, typeHelper<Scalar>(),
+                                                   static_cast<MW::mxComplexity>(false));
+    if(!newval) {
+        throw(std::runtime_error("Out of memory"));
+    }
+
+    Scalar* data = static_cast<Scalar*>(MW::mxGetData(newval));
+    for(std::size_t i=0; i < values.size(); i++) {
+        data[i] = values[i];
+    }
+
+    m.putScalar(varname, newval);
+    MW::mxDestroyArray(newval);
+}
+
+
+template <typename Scalar>
+void compare(const std::string& filename, const std::string& typeName, std::size_t n) {
+    std::vector<Scalar> values(n);
+    for(std::size_t i=0; i < n; i++) {
+        values[i] = static_cast<Scalar>(i % 30011);
+    }
+    MW::mwSize dims[2] = {static_cast<MW::mwSize>(n), 1};
+
+    MATFile m(filename, "w");
+
+    auto start = Clock::now();
+    putArrayOneByOne(m, "one_by_one", values, 2, dims);
+    double before = secondsSince(start);
+
+    start = Clock::now();
+    m.putArray("put_array", values, 2, dims);
+    double after = secondsSince(start);
+
+    std::cout << n << " " << typeName << ": " << before << " s one by one, "
+              << after << " s with putArray (" << before / after << "x)" << std::endl;
+}
+
+
+int main(int argc, char* argv[]) {
+    std::string filename = argc > 1 ? argv[1] : "/dev/null";
+    std::size_t n = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 100000000;
+
+    compare<std::uint32_t>(filename, "uint32", n);
+    compare<double>(filename, "double", n);
+    return 0;
+}
@@ -35,6 +35,15 @@ int main() {
     MW::mwSize u8dims[3] = {2,4,1};
     m.putArray("vec_tiny", u8, 2, u8dims, true);
     
+    /* Big arrays can be written a piece at a time */
+    MW::mwSize sdims[2] = {3, MATFile::DEFERRED};
+    MATArrayStream<std::int16_t> stream = m.openArray<std::int16_t>("streamed", 2, sdims);
+    std::int16_t chunk[3] = {1, 2, 3};
+    for(int i=0; i<4; i++) {
+        stream.append(chunk, 3);
+    }
+    stream.close();
+    
     /* Structs are a little more complicated and require using the MW:: stuff still*/
     MW::mwSize scalar[2]= {2,1};
     const char* fieldnames[] = {"foo", "bar"};
@@ -0,0 +1,162 @@
+/* Tests for TextWriter's number formatting, which is done by hand (no
+   std::to_chars in C++14), so it has to be checked against the C library.
+
+   Usage: TextWriter-test [count]
+   Round-trips count random doubles (default 10^7) through formatDouble and
+   strtod. Exits with 1 on the first few failures. */
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+
+#include "textwriter.h"
+
+int failures = 0;
+
+void expect(const std::string& got, const std::string& want) {
+    if(got != want) {
+        std::cerr << "Expected " << want << ", got " << got << std::endl;
+        failures++;
+    }
+}
+
+std::string format(double v) {
+    char buffer[32];
+    return std::string(buffer, TextWriter::formatDouble(v, buffer));
+}
+
+template <typename T>
+std::string print(T v) {
+    std::ostringstream ss;
+    {
+        TextWriter w(ss);
+        w << v;
+    }
+    return ss.str();
+}
+
+
+bool roundTrips(double v) {
+    if(std::isnan(v))
+        return true;
+
+    const std::string s = format(v);
+    double back = std::strtod(s.c_str(), nullptr);
+    if(std::memcmp(&back, &v, sizeof(v)) != 0) {
+        std::cerr << "Doesn't round-trip: " << s << std::endl;
+        return false;
+    }
+
+    // No more than the 17 significant digits any double needs
+    int digits = 0;
+    bool leading = true;
+    for(char c : s) {
+        if(c == 'e')
+            break;
+        if(c < '0' || c > '9' || (leading && c == '0'))
+            continue;
+        leading = false;
+        digits++;
+    }
+    if(digits > 17 && (s.find('.') != std::string::npos || s.find('e') != std::string::npos)) {
+        std::cerr << "Too many digits: " << s << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+int main(int argc, char* argv[]) {
+    const long count = argc > 1 ? std::atol(argv[1]) : 10000000L;
+
+    /* Layout: fixed from 1e-4 up to 1e17, scientific outside that */
+    expect(format(0.0), "0");
+    expect(format(-0.0), "-0");
+    expect(format(1.0), "1");
+    expect(format(-2.5), "-2.5");
+    expect(format(0.1), "0.1");
+    expect(format(0.0001), "0.0001");
+    expect(format(0.00001), "1e-05");
+    expect(format(1.0 / 30000.0), "3.3333333333333335e-05");
+    expect(format(1e16), "10000000000000000");
+    expect(format(1e17), "1e+17");
+    expect(format(123456789012345680.0), "1.2345678901234568e+17");
+    expect(format(std::numeric_limits<double>::max()), "1.7976931348623157e+308");
+    expect(format(std::numeric_limits<double>::min()), "2.2250738585072014e-308");
+    expect(format(std::numeric_limits<double>::denorm_min()), "5e-324");
+    expect(format(std::numeric_limits<double>::infinity()), "inf");
+    expect(format(-std::numeric_limits<double>::infinity()), "-inf");
+    expect(format(std::numeric_limits<double>::quiet_NaN()), "nan");
+
+    /* Integers, including the extremes */
+    expect(print(0), "0");
+    expect(print(-5), "-5");
+    expect(print(std::numeric_limits<std::int16_t>::min()), "-32768");
+    expect(print(std::numeric_limits<std::uint16_t>::max()), "65535");
+    expect(print(std::numeric_limits<std::int64_t>::min()), "-9223372036854775808");
+    expect(print(std::numeric_limits<std::int64_t>::max()), "9223372036854775807");
+    expect(print(std::numeric_limits<std::uint64_t>::max()), "18446744073709551615");
+    for(std::uint64_t p = 1; p < 10000000000000000000ULL; p *= 10) {
+        expect(print(p), std::to_string(p));
+        expect(print(p - 1), std::to_string(p - 1));
+    }
+    expect(print('x'), "x");
+    expect(print(static_cast<std::int8_t>('y')), "y");
+
+    /* Random doubles: arbitrary bit patterns, plus the kinds of values
+       NEVExtract writes (times in seconds and scaled waveform samples) */
+    std::mt19937_64 rng(20260101);
+    for(long i = 0; i < count && failures < 10; i++) {
+        std::uint64_t bits = rng();
+        double v;
+        switch(i % 4) {
+        case 0:
+            std::memcpy(&v, &bits, sizeof(v));
+            break;
+        case 1:
+            v = double(bits % 4000000000ULL) / 30000.0;
+            break;
+        case 2:
+            v = double(std::int16_t(bits)) * 2.5e-7;
+            break;
+        default:
+            v = std::ldexp(double(bits >> 11), int(bits % 2000) - 1100);
+        }
+        if(!std::isinf(v) && !roundTrips(v))
+            failures++;
+    }
+
+    /* formatRows() must give the same bytes on any number of threads */
+    const std::size_t ROWS = 100000;
+    std::string expected;
+    for(unsigned threads : {1U, 2U, 3U, 8U}) {
+        std::ostringstream ss;
+        {
+            TextWriter w(ss);
+            formatRows(w, ROWS, threads, [](TextWriter& out, std::size_t begin, std::size_t end) {
+                    for(std::size_t r = begin; r < end; r++)
+                        out << r << ',' << double(r) / 30000.0 << '\n';
+                });
+        }
+        if(threads == 1)
+            expected = ss.str();
+        else if(ss.str() != expected) {
+            std::cerr << "formatRows on " << threads << " threads differs from 1 thread" << std::endl;
+            failures++;
+        }
+    }
+
+    if(failures) {
+        std::cerr << failures << " failure(s)" << std::endl;
+        return 1;
+    }
+    std::cout << "Finished successfully!" << std::endl;
+    return 0;
+}
@@ -0,0 +1,421 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+#include "textwriter.h"
+
+namespace {
+
+  const char DIGIT_PAIRS[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+
+  /* Grisu2 (Loitsch, "Printing floating-point numbers quickly and
+     accurately with integers", PLDI 2010). It produces digits that always
+     read back as the same double, and are the shortest such digits for
+     all but a tiny fraction of inputs. */
+  namespace grisu {
+
+    struct DiyFp {  // f * 2^e
+      std::uint64_t f;
+      int e;
+    };
+
+    DiyFp sub(DiyFp x, DiyFp y) {
+      return DiyFp{x.f - y.f, x.e};
+    }
+
+    /* The upper 64 bits of the product, rounded */
+    DiyFp mul(DiyFp x, DiyFp y) {
+      const std::uint64_t xlo = x.f & 0xFFFFFFFFU, xhi = x.f >> 32;
+      const std::uint64_t ylo = y.f & 0xFFFFFFFFU, yhi = y.f >> 32;
+
+      const std::uint64_t p0 = xlo * ylo;
+      const std::uint64_t p1 = xlo * yhi;
+      const std::uint64_t p2 = xhi * ylo;
+      const std::uint64_t p3 = xhi * yhi;
+
+      std::uint64_t mid = (p0 >> 32) + (p1 & 0xFFFFFFFFU) + (p2 & 0xFFFFFFFFU);
+      mid += std::uint64_t(1) << 31;
+
+      return DiyFp{p3 + (p1 >> 32) + (p2 >> 32) + (mid >> 32), x.e + y.e + 64};
+    }
+
+    DiyFp normalize(DiyFp x) {
+      while((x.f >> 63) == 0) {
+	x.f <<= 1;
+	x.e--;
+      }
+      return x;
+    }
+
+    /* v, and the boundaries halfway to its neighbours, with a common exponent */
+    void boundaries(double value, DiyFp &v, DiyFp &minus, DiyFp &plus) {
+      const std::uint64_t HIDDEN = std::uint64_t(1) << 52;
+      const int BIAS = 1075;  // 1023 + 52
+
+      std::uint64_t bits;
+      std::memcpy(&bits, &value, sizeof(bits));
+      const std::uint64_t E = (bits >> 52) & 0x7FF;
+      const std::uint64_t F = bits & (HIDDEN - 1);
+
+      v = (E == 0) ? DiyFp{F, 1 - BIAS} : DiyFp{F + HIDDEN, int(E) - BIAS};
+
+      // At a power of two, the gap below is half the gap above
+      const bool lowerCloser = (F == 0 && E > 1);
+      plus = normalize(DiyFp{2 * v.f + 1, v.e - 1});
+      minus = lowerCloser ? DiyFp{4 * v.f - 1, v.e - 2} : DiyFp{2 * v.f - 1, v.e - 1};
+      minus.f <<= (minus.e - plus.e);
+      minus.e = plus.e;
+      v = normalize(v);
+    }
+
+    struct CachedPower {  // 10^k ~= f * 2^e
+      std::uint64_t f;
+      int e;
+      int k;
+    };
+
+    const int ALPHA = -60;
+    const int GAMMA = -32;
+    const int MIN_DEC_EXP = -300;
+    const int DEC_STEP = 8;
+
+    const CachedPower POWERS[] = {
+      { 0xAB70FE17C79AC6CAULL, -1060,  -300 },
+      { 0xFF77B1FCBEBCDC4FULL, -1034,  -292 },
+      { 0xBE5691EF416BD60CULL, -1007,  -284 },
+      { 0x8DD01FAD907FFC3CULL,  -980,  -276 },
+      { 0xD3515C2831559A83ULL,  -954,  -268 },
+      { 0x9D71AC8FADA6C9B5ULL,  -927,  -260 },
+      { 0xEA9C227723EE8BCBULL,  -901,  -252 },
+      { 0xAECC49914078536DULL,  -874,  -244 },
+      { 0x823C12795DB6CE57ULL,  -847,  -236 },
+      { 0xC21094364DFB5637ULL,  -821,  -228 },
+      { 0x9096EA6F3848984FULL,  -794,  -220 },
+      { 0xD77485CB25823AC7ULL,  -768,  -212 },
+      { 0xA086CFCD97BF97F4ULL,  -741,  -204 },
+      { 0xEF340A98172AACE5ULL,  -715,  -196 },
+      { 0xB23867FB2A35B28EULL,  -688,  -188 },
+      { 0x84C8D4DFD2C63F3BULL,  -661,  -180 },
+      { 0xC5DD44271AD3CDBAULL,  -635,  -172 },
+      { 0x936B9FCEBB25C996ULL,  -608,  -164 },
+      { 0xDBAC6C247D62A584ULL,  -582,  -156 },
+      { 0xA3AB66580D5FDAF6ULL,  -555,  -148 },
+      { 0xF3E2F893DEC3F126ULL,  -529,  -140 },
+      { 0xB5B5ADA8AAFF80B8ULL,  -502,  -132 },
+      { 0x87625F056C7C4A8BULL,  -475,  -124 },
+      { 0xC9BCFF6034C13053ULL,  -449,  -116 },
+      { 0x964E858C91BA2655ULL,  -422,  -108 },
+      { 0xDFF9772470297EBDULL,  -396,  -100 },
+      { 0xA6DFBD9FB8E5B88FULL,  -369,   -92 },
+      { 0xF8A95FCF88747D94ULL,  -343,   -84 },
+      { 0xB94470938FA89BCFULL,  -316,   -76 },
+      { 0x8A08F0F8BF0F156BULL,  -289,   -68 },
+      { 0xCDB02555653131B6ULL,  -263,   -60 },
+      { 0x993FE2C6D07B7FACULL,  -236,   -52 },
+      { 0xE45C10C42A2B3B06ULL,  -210,   -44 },
+      { 0xAA242499697392D3ULL,  -183,   -36 },
+      { 0xFD87B5F28300CA0EULL,  -157,   -28 },
+      { 0xBCE5086492111AEBULL,  -130,   -20 },
+      { 0x8CBCCC096F5088CCULL,  -103,   -12 },
+      { 0xD1B71758E219652CULL,   -77,    -4 },
+      { 0x9C40000000000000ULL,   -50,     4 },
+      { 0xE8D4A51000000000ULL,   -24,    12 },
+      { 0xAD78EBC5AC620000ULL,     3,    20 },
+      { 0x813F3978F8940984ULL,    30,    28 },
+      { 0xC097CE7BC90715B3ULL,    56,    36 },
+      { 0x8F7E32CE7BEA5C70ULL,    83,    44 },
+      { 0xD5D238A4ABE98068ULL,   109,    52 },
+      { 0x9F4F2726179A2245ULL,   136,    60 },
+      { 0xED63A231D4C4FB27ULL,   162,    68 },
+      { 0xB0DE65388CC8ADA8ULL,   189,    76 },
+      { 0x83C7088E1AAB65DBULL,   216,    84 },
+      { 0xC45D1DF942711D9AULL,   242,    92 },
+      { 0x924D692CA61BE758ULL,   269,   100 },
+      { 0xDA01EE641A708DEAULL,   295,   108 },
+      { 0xA26DA3999AEF774AULL,   322,   116 },
+      { 0xF209787BB47D6B85ULL,   348,   124 },
+      { 0xB454E4A179DD1877ULL,   375,   132 },
+      { 0x865B86925B9BC5C2ULL,   402,   140 },
+      { 0xC83553C5C8965D3DULL,   428,   148 },
+      { 0x952AB45CFA97A0B3ULL,   455,   156 },
+      { 0xDE469FBD99A05FE3ULL,   481,   164 },
+      { 0xA59BC234DB398C25ULL,   508,   172 },
+      { 0xF6C69A72A3989F5CULL,   534,   180 },
+      { 0xB7DCBF5354E9BECEULL,   561,   188 },
+      { 0x88FCF317F22241E2ULL,   588,   196 },
+      { 0xCC20CE9BD35C78A5ULL,   614,   204 },
+      { 0x98165AF37B2153DFULL,   641,   212 },
+      { 0xE2A0B5DC971F303AULL,   667,   220 },
+      { 0xA8D9D1535CE3B396ULL,   694,   228 },
+      { 0xFB9B7CD9A4A7443CULL,   720,   236 },
+      { 0xBB764C4CA7A44410ULL,   747,   244 },
+      { 0x8BAB8EEFB6409C1AULL,   774,   252 },
+      { 0xD01FEF10A657842CULL,   800,   260 },
+      { 0x9B10A4E5E9913129ULL,   827,   268 },
+      { 0xE7109BFBA19C0C9DULL,   853,   276 },
+      { 0xAC2820D9623BF429ULL,   880,   284 },
+      { 0x80444B5E7AA7CF85ULL,   907,   292 },
+      { 0xBF21E44003ACDD2DULL,   933,   300 },
+      { 0x8E679C2F5E44FF8FULL,   960,   308 },
+      { 0xD433179D9C8CB841ULL,   986,   316 },
+      { 0x9E19DB92B4E31BA9ULL,  1013,   324 },
+    };
+
+    /* A power of ten that brings e into [ALPHA, GAMMA] */
+    const CachedPower& cachedPower(int e) {
+      const int f = ALPHA - e - 1;
+      const int k = (f * 78913) / (1 << 18) + (f > 0);  // ceil(f * log10(2))
+      return POWERS[(-MIN_DEC_EXP + k + (DEC_STEP - 1)) / DEC_STEP];
+    }
+
+    int largestPow10(std::uint32_t n, std::uint32_t &pow10) {
+      static const std::uint32_t POW10[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+      };
+      int digits = 10;
+      while(digits > 1 && n < POW10[digits - 1])
+	digits--;
+      pow10 = POW10[digits - 1];
+      return digits;
+    }
+
+    void round(char* buf, int len, std::uint64_t dist, std::uint64_t delta,
+	       std::uint64_t rest, std::uint64_t tenK) {
+      /* Walk the last digit down towards w while that stays in range and
+	 gets closer to it */
+      while(rest < dist && delta - rest >= tenK &&
+	    (rest + tenK < dist || dist - rest > rest + tenK - dist)) {
+	buf[len - 1]--;
+	rest += tenK;
+      }
+    }
+
+    /* Writes the digits of value (> 0) to buf, and returns how many; the
+       value is then buf * 10^exponent */
+    int digits(double value, char* buf, int &exponent) {
+      DiyFp v, mMinus, mPlus;
+      boundaries(value, v, mMinus, mPlus);
+
+      const CachedPower &c = cachedPower(mPlus.e);
+      const DiyFp cK{c.f, c.e};
+      const DiyFp w = mul(v, cK);
+      const DiyFp wMinus = mul(mMinus, cK);
+      const DiyFp wPlus = mul(mPlus, cK);
+
+      // Stay safely inside the (now inexact) boundaries
+      const DiyFp lo{wMinus.f + 1, wMinus.e};
+      const DiyFp hi{wPlus.f - 1, wPlus.e};
+      exponent = -c.k;
+
+      std::uint64_t delta = sub(hi, lo).f;
+      std::uint64_t dist = sub(hi, w).f;
+
+      const DiyFp one{std::uint64_t(1) << -hi.e, hi.e};
+      std::uint32_t p1 = std::uint32_t(hi.f >> -one.e);
+      std::uint64_t p2 = hi.f & (one.f - 1);
+
+      int len = 0;
+      std::uint32_t pow10;
+      int n = largestPow10(p1, pow10);
+
+      // Integral part
+      while(n > 0) {
+	buf[len++] = char('0' + p1 / pow10);
+	p1 %= pow10;
+	n--;
+
+	const std::uint64_t rest = (std::uint64_t(p1) << -one.e) + p2;
+	if(rest <= delta) {
+	  exponent += n;
+	  round(buf, len, dist, delta, rest, std::uint64_t(pow10) << -one.e);
+	  return len;
+	}
+	pow10 /= 10;
+      }
+
+      // Fractional part
+      int m = 0;
+      for(;;) {
+	p2 *= 10;
+	buf[len++] = char('0' + (p2 >> -one.e));
+	p2 &= one.f - 1;
+	m++;
+
+	delta *= 10;
+	dist *= 10;
+	if(p2 <= delta)
+	  break;
+      }
+      exponent -= m;
+      round(buf, len, dist, delta, p2, one.f);
+      return len;
+    }
+  }
+
+
+  /* Lays out len digits, times 10^exponent, like %g would */
+  std::size_t layout(const char* digits, int len, int exponent, char* dest) {
+    const int point = len + exponent;  // Digits before the decimal point
+    const int sciExp = point - 1;
+    char* p = dest;
+
+    if(sciExp >= -4 && sciExp <= 16) {
+      if(point >= len) {
+	std::memcpy(p, digits, len);
+	p += len;
+	std::memset(p, '0', point - len);
+	p += point - len;
+      } else if(point > 0) {
+	std::memcpy(p, digits, point);
+	p += point;
+	*p++ = '.';
+	std::memcpy(p, digits + point, len - point);
+	p += len - point;
+      } else {
+	*p++ = '0';
+	*p++ = '.';
+	std::memset(p, '0', -point);
+	p += -point;
+	std::memcpy(p, digits, len);
+	p += len;
+      }
+    } else {
+      *p++ = digits[0];
+      if(len > 1) {
+	*p++ = '.';
+	std::memcpy(p, digits + 1, len - 1);
+	p += len - 1;
+      }
+      *p++ = 'e';
+      *p++ = sciExp < 0 ? '-' : '+';
+
+      unsigned e = unsigned(sciExp < 0 ? -sciExp : sciExp);
+      if(e >= 100)
+	*p++ = char('0' + e / 100);
+      *p++ = DIGIT_PAIRS[2 * (e % 100)];
+      *p++ = DIGIT_PAIRS[2 * (e % 100) + 1];
+    }
+    return std::size_t(p - dest);
+  }
+}
+
+
+TextWriter::TextWriter(std::ostream &_out, std::size_t capacity) :
+  out(_out), buffer(std::max<std::size_t>(capacity, 64)), used(0) {
+}
+
+
+TextWriter::~TextWriter() {
+  try {
+    flush();
+  } catch(...) {
+    // Call flush() yourself to find out about errors
+  }
+}
+
+
+TextWriter& TextWriter::operator<<(const char* s) {
+  return write(s, std::strlen(s));
+}
+
+
+TextWriter& TextWriter::write(const char* s, std::size_t n) {
+  if(buffer.size() - used < n) {
+    flush();
+    if(n > buffer.size()) {
+      out.write(s, std::streamsize(n));
+      return *this;
+    }
+  }
+  std::memcpy(buffer.data() + used, s, n);
+  used += n;
+  return *this;
+}
+
+
+TextWriter& TextWriter::putSigned(long long v) {
+  char* dest = reserve(32);
+  if(v < 0) {
+    *dest++ = '-';
+    used++;
+    // Negate as unsigned, so the most negative value doesn't overflow
+    used += formatUnsigned(0 - static_cast<unsigned long long>(v), dest);
+  } else {
+    used += formatUnsigned(static_cast<unsigned long long>(v), dest);
+  }
+  return *this;
+}
+
+
+TextWriter& TextWriter::operator<<(double v) {
+  used += formatDouble(v, reserve(32));
+  return *this;
+}
+
+
+void TextWriter::flush() {
+  if(used > 0) {
+    out.write(buffer.data(), std::streamsize(used));
+    used = 0;
+  }
+  if(!out)
+    throw(std::runtime_error("Unable to write text output"));
+}
+
+
+std::size_t TextWriter::formatUnsigned(std::uint64_t v, char* dest) {
+  char tmp[20];
+  char* p = tmp + sizeof(tmp);
+
+  while(v >= 100) {
+    const unsigned pair = unsigned(v % 100) * 2;
+    v /= 100;
+    *--p = DIGIT_PAIRS[pair + 1];
+    *--p = DIGIT_PAIRS[pair];
+  }
+  if(v >= 10) {
+    *--p = DIGIT_PAIRS[2 * v + 1];
+    *--p = DIGIT_PAIRS[2 * v];
+  } else {
+    *--p = char('0' + v);
+  }
+
+  const std::size_t n = std::size_t(tmp + sizeof(tmp) - p);
+  std::memcpy(dest, p, n);
+  return n;
+}
+
+
+std::size_t TextWriter::formatDouble(double v, char* dest) {
+  char* p = dest;
+  if(std::signbit(v)) {
+    *p++ = '-';
+    v = -v;
+  }
+
+  if(std::isnan(v)) {
+    std::memcpy(p, "nan", 3);
+    return std::size_t(p - dest) + 3;
+  }
+  if(std::isinf(v)) {
+    std::memcpy(p, "inf", 3);
+    return std::size_t(p - dest) + 3;
+  }
+  if(v == 0) {
+    *p++ = '0';
+    return std::size_t(p - dest);
+  }
+
+  char digits[18];
+  int exponent;
+  int len = grisu::digits(v, digits, exponent);
+  return std::size_t(p - dest) + layout(digits, len, exponent, p);
+}
@@ -0,0 +1,147 @@
+#pragma once
+#ifndef TEXTWRITER_H_INCLUDED
+#define TEXTWRITER_H_INCLUDED
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef WINDOWS
+#include "mingw.thread.h"
+#endif
+
+#include <thread>
+
+/* TextWriter: formats numbers and text straight into a large buffer, which
+   goes to an ostream in one write whenever it fills up. It's used like an
+   ostream, but without locales, sentries or virtual calls per value, which
+   otherwise make the CSV and text exporters CPU-bound.
+
+   Integers are converted two digits at a time. Doubles are printed with
+   enough digits to read back as exactly the same double; Grisu2 finds the
+   fewest such digits for nearly every value, and a few more for the rest.
+   They're in fixed notation unless the exponent is below -4 or above 16
+   (e.g., 0.0001, 1e-05, 1e+17). Unlike an ostream, chars of any
+   signedness are printed as characters, and nothing else (flags,
+   precision, width) is supported.
+
+   Anything written directly to the ostream in the meantime will come out
+   of order, so flush() first.
+*/
+class TextWriter {
+public:
+  TextWriter(std::ostream &out, std::size_t capacity = 1 << 20);
+  ~TextWriter();
+
+  TextWriter(const TextWriter &rhs) = delete;
+  TextWriter& operator=(const TextWriter &rhs) = delete;
+
+  TextWriter& operator<<(char c) {
+    reserve(1)[0] = c;
+    used++;
+    return *this;
+  }
+  TextWriter& operator<<(signed char c)   { return *this << char(c); }
+  TextWriter& operator<<(unsigned char c) { return *this << char(c); }
+  TextWriter& operator<<(const char* s);
+  TextWriter& operator<<(const std::string &s) { return write(s.data(), s.size()); }
+
+  TextWriter& operator<<(short v)              { return putSigned(v); }
+  TextWriter& operator<<(int v)                { return putSigned(v); }
+  TextWriter& operator<<(long v)               { return putSigned(v); }
+  TextWriter& operator<<(long long v)          { return putSigned(v); }
+  TextWriter& operator<<(unsigned short v)     { return putUnsigned(v); }
+  TextWriter& operator<<(unsigned int v)       { return putUnsigned(v); }
+  TextWriter& operator<<(unsigned long v)      { return putUnsigned(v); }
+  TextWriter& operator<<(unsigned long long v) { return putUnsigned(v); }
+
+  TextWriter& operator<<(double v);
+  TextWriter& operator<<(float v) { return *this << double(v); }
+
+  TextWriter& write(const char* s, std::size_t n);
+  void flush();
+
+  /* Formats v into dest, which must have room for 32 chars, and returns the
+     number written. Nothing is NUL-terminated. */
+  static std::size_t formatUnsigned(std::uint64_t v, char* dest);
+  static std::size_t formatDouble(double v, char* dest);
+
+private:
+  char* reserve(std::size_t n) {
+    if(buffer.size() - used < n)
+      flush();
+    return buffer.data() + used;
+  }
+
+  TextWriter& putSigned(long long v);
+  TextWriter& putUnsigned(unsigned long long v) {
+    used += formatUnsigned(v, reserve(32));
+    return *this;
+  }
+
+  std::ostream &out;
+  std::vector<char> buffer;
+  std::size_t used;
+};
+
+
+/* Writes rows [0, n) to out with fn(TextWriter &w, first, stop), which must
+   format rows [first, stop) into w and touch nothing shared. The rows are
+   split into one contiguous range per thread; the first range goes straight
+   to out, and the others are formatted in memory and copied after it, in
+   order. */
+template <typename Fn>
+void formatRows(TextWriter &out, std::size_t n, unsigned nThreads, Fn fn) {
+  // Below this, starting threads costs more than it saves
+  const std::size_t MIN_ROWS_PER_THREAD = 1 << 12;
+
+  nThreads = unsigned(std::max<std::size_t>(1, std::min<std::size_t>(nThreads, n / MIN_ROWS_PER_THREAD)));
+  if(nThreads < 2) {
+    fn(out, 0, n);
+    return;
+  }
+
+  std::vector<std::string> parts(nThreads);
+  std::vector<std::exception_ptr> errors(nThreads);
+
+  auto formatPart = [&](unsigned k) {
+    try {
+      std::ostringstream ss;
+      {
+	TextWriter w(ss, 1 << 16);
+	fn(w, n * k / nThreads, n * (k + 1) / nThreads);
+	w.flush();
+      }
+      parts[k] = ss.str();
+    } catch(...) {
+      errors[k] = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for(auto k = 1U; k < nThreads; k++)
+    threads.push_back(std::thread(formatPart, k));
+
+  try {
+    fn(out, 0, n / nThreads);
+  } catch(...) {
+    errors[0] = std::current_exception();
+  }
+  for(auto &t : threads)
+    t.join();
+
+  for(auto &e : errors) {
+    if(e)
+      std::rethrow_exception(e);
+  }
+
+  for(auto k = 1U; k < nThreads; k++)
+    out.write(parts[k].data(), parts[k].size());
+}
+
+#endif
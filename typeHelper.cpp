@@ -55,3 +55,8 @@ template <>
 MW::mxClassID typeHelper<char>() {
     return(MW::mxCHAR_CLASS);
 }
+
+template <>
+MW::mxClassID typeHelper<bool>() {
+    return(MW::mxLOGICAL_CLASS);
+}
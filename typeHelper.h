@@ -10,11 +10,15 @@
 #include <cstdint>
 
 
+#ifdef NATIVE_MAT_FILE
+#include "matv5.h"
+#else
 namespace MW {
   // These are the original header files from the MathWorks.
   #include "mat.h"
   #include "matrix.h"
 };
+#endif
 
 
 
@@ -54,5 +58,8 @@ MW::mxClassID typeHelper<float>();
 template <>
 MW::mxClassID typeHelper<double>();
 
+template <>
+MW::mxClassID typeHelper<bool>();
+
 
 #endif
@@ -0,0 +1,183 @@
+#include "waveform.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define WAVEFORM_HAVE_SSE2 1
+#endif
+
+#if defined(WAVEFORM_HAVE_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define WAVEFORM_HAVE_AVX2 1
+#endif
+
+namespace {
+
+  typedef void (*volts_kernel)(const char*, std::size_t, double, double*);
+
+  /* Each kernel converts n samples of one width. The integers convert to
+     double exactly and are then multiplied by scale, so the SIMD kernels
+     round exactly as the scalar ones do. */
+  template <typename T>
+  void volts_scalar(const char* src, std::size_t n, double scale, double* dest) {
+    for(std::size_t i = 0; i < n; i++) {
+      T raw;
+      std::memcpy(&raw, src + i * sizeof(T), sizeof(T));
+      dest[i] = static_cast<double>(raw) * scale;
+    }
+  }
+
+
+#ifdef WAVEFORM_HAVE_SSE2
+  /* Converts the four int32s in v, storing them at dest */
+  inline void store4_sse2(__m128i v, __m128d scale, double* dest) {
+    _mm_storeu_pd(dest, _mm_mul_pd(_mm_cvtepi32_pd(v), scale));
+    _mm_storeu_pd(dest + 2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(v, 8)), scale));
+  }
+
+  /* Converts the eight int16s in v. SSE2 has no sign-extending load, so
+     each one is duplicated and shifted down. */
+  inline void store8_sse2(__m128i v, __m128d scale, double* dest) {
+    store4_sse2(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16), scale, dest);
+    store4_sse2(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16), scale, dest + 4);
+  }
+
+  void volts8_sse2(const char* src, std::size_t n, double scale, double* dest) {
+    const __m128d s = _mm_set1_pd(scale);
+    std::size_t i = 0;
+    for(; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+      store8_sse2(_mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8), s, dest + i);
+      store8_sse2(_mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8), s, dest + i + 8);
+    }
+    volts_scalar<std::int8_t>(src + i, n - i, scale, dest + i);
+  }
+
+  void volts16_sse2(const char* src, std::size_t n, double scale, double* dest) {
+    const __m128d s = _mm_set1_pd(scale);
+    std::size_t i = 0;
+    for(; i + 8 <= n; i += 8)
+      store8_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2)), s, dest + i);
+    volts_scalar<std::int16_t>(src + i * 2, n - i, scale, dest + i);
+  }
+
+  void volts32_sse2(const char* src, std::size_t n, double scale, double* dest) {
+    const __m128d s = _mm_set1_pd(scale);
+    std::size_t i = 0;
+    for(; i + 4 <= n; i += 4)
+      store4_sse2(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 4)), s, dest + i);
+    volts_scalar<std::int32_t>(src + i * 4, n - i, scale, dest + i);
+  }
+#endif
+
+
+#ifdef WAVEFORM_HAVE_AVX2
+  __attribute__((target("avx2")))
+  inline void store8_avx2(__m256i v, __m256d scale, double* dest) {
+    _mm256_storeu_pd(dest, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(v)), scale));
+    _mm256_storeu_pd(dest + 4, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)), scale));
+  }
+
+  __attribute__((target("avx2")))
+  void volts8_avx2(const char* src, std::size_t n, double scale, double* dest) {
+    const __m256d s = _mm256_set1_pd(scale);
+    std::size_t i = 0;
+    for(; i + 8 <= n; i += 8)
+      store8_avx2(_mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i))), s, dest + i);
+    volts_scalar<std::int8_t>(src + i, n - i, scale, dest + i);
+  }
+
+  __attribute__((target("avx2")))
+  void volts16_avx2(const char* src, std::size_t n, double scale, double* dest) {
+    const __m256d s = _mm256_set1_pd(scale);
+    std::size_t i = 0;
+    for(; i + 8 <= n; i += 8)
+      store8_avx2(_mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2))), s, dest + i);
+    volts_scalar<std::int16_t>(src + i * 2, n - i, scale, dest + i);
+  }
+
+  __attribute__((target("avx2")))
+  void volts32_avx2(const char* src, std::size_t n, double scale, double* dest) {
+    const __m256d s = _mm256_set1_pd(scale);
+    std::size_t i = 0;
+    for(; i + 8 <= n; i += 8)
+      store8_avx2(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * 4)), s, dest + i);
+    volts_scalar<std::int32_t>(src + i * 4, n - i, scale, dest + i);
+  }
+#endif
+
+
+  struct Kernel {
+    volts_kernel int8;
+    volts_kernel int16;
+    volts_kernel int32;
+    const char* name;
+  };
+
+  Kernel pickKernel() {
+#ifdef WAVEFORM_HAVE_AVX2
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+      return Kernel{volts8_avx2, volts16_avx2, volts32_avx2, "avx2"};
+#endif
+#ifdef WAVEFORM_HAVE_SSE2
+    return Kernel{volts8_sse2, volts16_sse2, volts32_sse2, "sse2"};
+#else
+    return Kernel{volts_scalar<std::int8_t>, volts_scalar<std::int16_t>, volts_scalar<std::int32_t>, "scalar"};
+#endif
+  }
+
+  const Kernel& kernel() {
+    static const Kernel k = pickKernel(); // Thread-safe since C++11
+    return k;
+  }
+}
+
+
+void toVolts(const char* src, std::size_t n, unsigned bytesPerSample,
+	     double scale, double* dest) {
+  switch(bytesPerSample) {
+  case 1:
+    kernel().int8(src, n, scale, dest);
+    break;
+  case 2:
+    kernel().int16(src, n, scale, dest);
+    break;
+  case 4:
+    kernel().int32(src, n, scale, dest);
+    break;
+  default:
+    throw(std::runtime_error("Unpacking " + std::to_string(bytesPerSample) +
+			     " bytes per sample is not supported (yet)."));
+  }
+}
+
+
+void decodeWaveforms(const char* raw, const std::uint32_t* lengths, std::size_t count,
+		     unsigned bytesPerSample, double scale, std::size_t nSamples, double* dest) {
+  toVolts(raw, count * nSamples, bytesPerSample, scale, dest);
+
+  for(std::size_t k = 0; k < count; k++) {
+    double* column = dest + k * nSamples;
+    std::fill(column + std::min<std::size_t>(lengths[k], nSamples), column + nSamples,
+	      std::numeric_limits<double>::quiet_NaN());
+  }
+}
+
+
+void decodeWaveform(const char* wave, std::size_t len, unsigned bytesPerSample,
+		    double scale, std::size_t nSamples, double* dest) {
+  std::size_t n = std::min<std::size_t>(nSamples, len / std::max(bytesPerSample, 1U));
+  toVolts(wave, n, bytesPerSample, scale, dest);
+  std::fill(dest + n, dest + nSamples, std::numeric_limits<double>::quiet_NaN());
+}
+
+
+const char* waveformKernelName() {
+  return kernel().name;
+}
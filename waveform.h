@@ -0,0 +1,39 @@
+#pragma once
+#ifndef WAVEFORM_H_INCLUDED
+#define WAVEFORM_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+
+/* Converting raw spike and stim waveforms to volts. The samples are signed
+   little-endian integers of 1, 2 or 4 bytes, scaled by the electrode's
+   volts per bit. They don't need to be aligned.
+
+   There are SSE2 and AVX2 versions of the widening and scaling; as with
+   deinterleave(), the fastest one the CPU supports is picked the first time
+   one of these is called. Every version gives exactly the same doubles.
+
+   A writer with many waveforms from the same electrode should hand them to
+   decodeWaveforms() together, so they're converted in one pass.
+*/
+
+/* Converts n samples of bytesPerSample bytes each to volts */
+void toVolts(const char* src, std::size_t n, unsigned bytesPerSample,
+	     double scale, double* dest);
+
+/* Converts count waveforms from one electrode. raw holds them back to back,
+   each padded to nSamples samples (the padding can be anything), and
+   lengths[k] is how many samples waveform k really has. dest (nSamples x
+   count) receives one waveform per column, padded with NaN. */
+void decodeWaveforms(const char* raw, const std::uint32_t* lengths, std::size_t count,
+		     unsigned bytesPerSample, double scale, std::size_t nSamples, double* dest);
+
+/* Fills dest (nSamples long) with a single len-byte waveform, in volts. A
+   short waveform is padded with NaN. */
+void decodeWaveform(const char* wave, std::size_t len, unsigned bytesPerSample,
+		    double scale, std::size_t nSamples, double* dest);
+
+/* Name of the kernel toVolts() dispatches to: "avx2", "sse2", or "scalar" */
+const char* waveformKernelName();
+
+#endif